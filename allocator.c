@@ -1,18 +1,48 @@
+#define _GNU_SOURCE // sched_getcpu()
+
 #include <alloca.h>
 #include <assert.h>
 #include <errno.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 #define DBG(fmt, ...) fprintf(stderr, "[DBG] " fmt "\n", ##__VA_ARGS__)
 
 static const uint16_t HEAP_SIZE = 4096;
 static const uint8_t HEAP_ALIGN = 8;
 
+// Number of HEAP_ALIGN granules in the heap (HEAP_SIZE / HEAP_ALIGN); a macro
+// because it sizes arrays inside allocator_t.
+#define HEAP_GRANULES 512
+#define FREE_MAP_WORDS (HEAP_GRANULES / 64)
+
+// Generated by sizeclass_gen; see `make size-classes`.
+#include "size_classes.h"
+
+// Clears at least this long use non-temporal stores, so that zeroing a big
+// block does not evict the rest of the cache.
+#define ZERO_NT_THRESHOLD 2048
+
+// How many free-block candidates the prefetching scan runs ahead of the cursor.
+#define PREFETCH_DISTANCE 4
+
 typedef uint16_t raw_boundary_t;
 
 struct boundary_t {
@@ -51,30 +81,336 @@ static inline void put_boundaries(uint8_t *ptr, boundary_t boundary) {
     }
 }
 
-void error(char *msg) {
-    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
-    exit(EXIT_FAILURE);
+// Raw tag fast path: the hot paths manipulate raw_boundary_t with masks rather
+// than going through unpack() and pack().
+#define RAW_ALLOC ((raw_boundary_t)1)
+#define RAW_P_ALLOC ((raw_boundary_t)2)
+
+static inline uint16_t raw_length(raw_boundary_t raw) { return raw >> 2; }
+
+static inline raw_boundary_t *raw_at(uint8_t *ptr) {
+    return (raw_boundary_t *)ptr;
+}
+
+// Write both boundaries of a free block from one computed value.
+static inline void put_free_raw(uint8_t *ptr, raw_boundary_t raw) {
+    *raw_at(ptr) = raw;
+    *raw_at(ptr + raw_length(raw) - sizeof(raw_boundary_t)) = raw;
+}
+
+// Set the p_alloc bit of the block at ptr, keeping the footer of a free block
+// in sync. Where the block is known to be allocated, a single OR/AND on the
+// header does the same.
+static inline void put_p_alloc_raw(uint8_t *ptr, bool p_alloc) {
+    raw_boundary_t raw =
+        (*raw_at(ptr) & ~RAW_P_ALLOC) | ((raw_boundary_t)p_alloc << 1);
+    *raw_at(ptr) = raw;
+    if (!(raw & RAW_ALLOC)) {
+        *raw_at(ptr + raw_length(raw) - sizeof(raw_boundary_t)) = raw;
+    }
 }
 
+// Returns NULL on failure, with errno set.
 void *Mmap(size_t length) {
     void *res;
 
     if ((res = mmap(NULL, length, PROT_READ | PROT_WRITE,
                     MAP_ANON | MAP_PRIVATE, 0, 0)) == MAP_FAILED) {
-        error("mmap");
+        return NULL;
     }
 
     return res;
 }
 
-void Munmap(void *ptr, size_t length) {
-    if (munmap(ptr, length) < 0) {
-        error("munmap");
+// Returns false on failure, with errno set.
+bool Munmap(void *ptr, size_t length) { return munmap(ptr, length) == 0; }
+
+// Lifetime prediction; see allocator_predict_enable().
+#define PREDICT_SITES 64
+#define PREDICT_NO_SITE 0xff
+#define PREDICT_MIN_SAMPLES 8
+// Lifetimes are measured in ticks of a clock that advances on every
+// allocation and deallocation.
+#define PREDICT_SHORT_LIFETIME 64
+
+struct site_t {
+    void *address;     // Return address of the allocate() call; NULL if unused.
+    uint32_t samples;  // Deallocations seen.
+    uint32_t lifetime; // Moving average of the observed lifetimes.
+};
+
+typedef struct site_t site_t;
+
+struct predictor_t {
+    site_t sites[PREDICT_SITES];
+    uint32_t clock;
+    // Site and birth time of each live allocation, by granule of its address
+    // (its block for heap allocations, itself for arena ones).
+    uint8_t site_of[HEAP_GRANULES];
+    uint32_t birth[HEAP_GRANULES];
+
+    // Bump arena for sites predicted to be short-lived, carved out of the
+    // heap as one block and rewound whenever it empties.
+    uint8_t *arena_block;
+    uint8_t *arena;
+    uint8_t *arena_end;
+    uint8_t *bump;
+    uint16_t arena_live;
+    uint64_t arena_map[FREE_MAP_WORDS]; // Live arena allocations, by granule.
+
+    size_t arena_allocations;
+    size_t arena_resets;
+    size_t arena_full;
+};
+
+typedef struct predictor_t predictor_t;
+
+// Deferred deallocation; see deallocate_async().
+#define DEFERRED_CAPACITY 1024
+#define DEFERRED_BATCH 64
+#define DEFERRED_IDLE_NS 50000 // Helper thread's nap when the queue is empty.
+
+struct deferred_slot_t {
+    atomic_size_t seq;
+    void *ptr;
+};
+
+// Bounded multi-producer queue of pointers to free, drained in batches by a
+// helper thread (or by deallocate_flush()).
+struct deferred_t {
+    struct deferred_slot_t slots[DEFERRED_CAPACITY];
+    atomic_size_t tail;         // Next slot to fill.
+    size_t head;                // Next slot to drain; under drain_lock.
+    pthread_mutex_t drain_lock; // Serialises the consumers.
+    pthread_t thread;
+    atomic_bool running;
+
+    size_t batches;
+    size_t frees;
+    atomic_size_t overflows; // Freed synchronously since the queue was full.
+};
+
+typedef struct deferred_t deferred_t;
+
+// Epoch-based reclamation; see allocator_epoch_enable().
+#define EPOCH_THREADS 16
+#define EPOCH_BATCH 64 // Retirements between two attempts to reclaim.
+
+// Blocks retired by one thread during one epoch.
+struct limbo_t {
+    void **ptrs;
+    size_t count;
+    size_t capacity;
+    unsigned long epoch;
+};
+
+struct epoch_thread_t {
+    struct allocator_t *alloc;
+    atomic_bool used;
+    // Global epoch seen at the thread's last quiescent point.
+    atomic_ulong local;
+    // Retired blocks by epoch % 3; only touched by the owning thread.
+    struct limbo_t limbo[3];
+    size_t until_collect;
+};
+
+typedef struct epoch_thread_t epoch_thread_t;
+
+struct epoch_t {
+    atomic_ulong global;
+    epoch_thread_t threads[EPOCH_THREADS];
+
+    atomic_size_t retired;
+    atomic_size_t reclaimed;
+    atomic_size_t advances;
+};
+
+typedef struct epoch_t epoch_t;
+
+// Lifetime hints for allocate_hint().
+enum alloc_hint_t {
+    ALLOC_SHORT = 1 << 0,     // Short-lived; served from the bottom.
+    ALLOC_LONG = 1 << 1,      // Long-lived; served from the top.
+    ALLOC_PERMANENT = 1 << 2, // Never freed; served from the top.
+};
+
+// What deallocate() does with a pointer that is not an allocated block.
+enum free_policy_t {
+    FREE_LOG,    // Report it with DBG and ignore it.
+    FREE_ABORT,  // Abort the process.
+    FREE_IGNORE, // Ignore it silently.
+};
+
+typedef enum free_policy_t free_policy_t;
+
+enum scan_t {
+    SCAN_IMPLICIT, // Walk every block through the boundary tags.
+    SCAN_PREFETCH, // Walk free blocks through free_map, prefetching ahead.
+    SCAN_ORDERED,  // Walk the address-ordered free list of the free index.
+    SCAN_TREE,     // Descend free_tree to the lowest block that fits.
+};
+
+typedef enum scan_t scan_t;
+
+// Per-tenant accounting; see allocator_tenants_enable().
+#define TENANT_MAX 8
+#define TENANT_NONE 0xff
+#define TENANT_CPUS 8
+// How far a CPU's share of a tenant's usage may drift before it is folded
+// into the shared total.
+#define TENANT_BATCH 256
+
+struct tenant_cpu_t {
+    _Alignas(64) atomic_long delta;
+};
+
+struct tenant_t {
+    atomic_long usage; // Bytes charged, apart from what the CPUs hold back.
+    struct tenant_cpu_t cpus[TENANT_CPUS];
+    size_t soft_limit; // 0 for none.
+    size_t hard_limit; // 0 for none.
+
+    atomic_size_t hard_failures; // Allocations refused for the hard limit.
+    atomic_size_t soft_trims;    // Trims run for the soft limit.
+};
+
+typedef struct tenant_t tenant_t;
+
+struct tenants_t {
+    tenant_t tenants[TENANT_MAX];
+    // Tenant charged for the block starting at each granule.
+    uint8_t owner[HEAP_GRANULES];
+};
+
+typedef struct tenants_t tenants_t;
+
+// The shared total plus every CPU's share.
+static long tenant_total(tenant_t *tenant) {
+    long usage = atomic_load(&tenant->usage);
+
+    for (int cpu = 0; cpu < TENANT_CPUS; cpu++) {
+        usage += atomic_load(&tenant->cpus[cpu].delta);
     }
+
+    return usage;
 }
 
+// Per-thread runs for small objects; see allocator_isolate_enable().
+#define RUN_MAX 16
+#define RUN_LENGTH 256 // Whole cache lines.
+#define RUN_SMALL 32   // Longest request served from a run.
+
+// A cache-line-aligned run of RUN_LENGTH bytes inside a heap block, handed
+// out by bumping a pointer to the one thread that owns it. A full run is
+// retired and its block freed once everything in it is; an empty run that is
+// still owned is rewound.
+struct run_t {
+    uint8_t *block; // Payload of the heap block holding the run, or NULL.
+    uint8_t *start;
+    uint8_t *end;
+    uint8_t *bump;
+    pthread_t owner;
+    bool owned;
+    uint16_t live;
+    uint32_t slots; // Live allocations, a bit for each of the run's granules.
+};
+
+typedef struct run_t run_t;
+
+struct runs_t {
+    run_t runs[RUN_MAX];
+    size_t run_allocations;
+    size_t runs_claimed; // Runs taken from the heap.
+};
+
+typedef struct runs_t runs_t;
+
+// Index of the free blocks; see allocator_index_enable().
+#define SKIP_LEVELS 4
+#define SKIP_NIL 0xffff
+#define SKIP_HEAD HEAP_GRANULES // The head node, ahead of every granule.
+
+// Skip list over the free blocks by address, with the nodes numbered by the
+// granule the block starts at. Level 0 is the address-ordered explicit free
+// list, and is doubly linked; the levels above skip ahead over it, each
+// holding about a quarter of the nodes of the one below. A node x on level l
+// spans the blocks from x up to next[l][x], and span_max[l][x] is the length
+// of the longest of them, so a first fit can skip whole spans.
+struct free_index_t {
+    uint16_t next[SKIP_LEVELS][HEAP_GRANULES + 1];
+    uint16_t span_max[SKIP_LEVELS][HEAP_GRANULES + 1];
+    uint16_t prev[HEAP_GRANULES + 1];
+    uint16_t length[HEAP_GRANULES + 1]; // Of the free block, 0 for the head.
+    uint8_t height[HEAP_GRANULES + 1];
+    uint32_t seed; // Of the node heights.
+
+    size_t neighbour_inserts; // Took a neighbour's place, in its search.
+    size_t searched_inserts;  // Insertion point searched for.
+};
+
+typedef struct free_index_t free_index_t;
+
+// Free blocks shorter than this are splinters, too short for most requests.
+#define SPLINTER_LENGTH 32
+// Allocations between two adjustments of an adaptive split threshold.
+#define SPLIT_WINDOW 256
+
+// Retries of a failed allocation after the out-of-memory callback.
+#define OOM_RETRIES 3
+
+#define CACHE_LINE 64
+// Fitting free blocks line-aware placement looks at before it settles for a
+// block that straddles a cache line.
+#define LINE_WINDOW 8
+
 struct allocator_t {
     uint8_t *heap;
+    // Where the heap came from: its own mapping, a heap_region_t, or else the
+    // caller's buffer.
+    bool mapped;
+    struct heap_region_t *region;
+    // Whether the heap has its boundary tags yet; see heap_ready().
+    bool formatted;
+    bool fresh; // The heap is known to be zero until it is formatted.
+    // Held around the heap by anything that uses it from several threads.
+    pthread_mutex_t lock;
+    scan_t scan;
+    bool size_classes; // Round requests up to SIZE_CLASS_LENGTH.
+    free_policy_t invalid_free;
+    // Least remainder worth splitting off a free block; shorter ones stay with
+    // the allocated block.
+    uint16_t split_threshold;
+    bool split_adaptive; // Tune split_threshold from the splinter counts.
+    // Keep blocks of up to CACHE_LINE bytes from straddling a cache line.
+    bool line_aware;
+    FILE *trace;       // If set, every request is logged here.
+    predictor_t *predict; // Lifetime prediction, if enabled.
+    runs_t *runs;         // Per-thread runs, if enabled.
+    deferred_t *deferred; // Deferred deallocation, if started.
+    epoch_t *epoch;       // Epoch-based reclamation, if enabled.
+    // Called when a block of length bytes (boundary and padding included)
+    // does not fit; returns whether it released any memory, in which case
+    // the allocation is retried. It runs under whatever lock the caller of
+    // allocate() holds, so it may deallocate() but not take alloc->lock.
+    bool (*oom)(struct allocator_t *alloc, uint16_t length, void *arg);
+    void *oom_arg;
+    uint8_t *reserve; // Emergency block; see allocator_reserve().
+    tenants_t *tenants; // Per-tenant accounting, if enabled.
+    free_index_t *index; // Address-ordered free index, if enabled.
+
+    // One bit per granule, set iff a free block starts at that granule.
+    uint64_t free_map[FREE_MAP_WORDS];
+    // One bit per granule, set if the granule is known to be zero apart from
+    // the boundary tags of the free block it is in. Only meaningful for free
+    // blocks.
+    uint64_t zero_map[FREE_MAP_WORDS];
+    // One bit per granule, set iff an allocated block starts at that granule.
+    uint64_t alloc_map[FREE_MAP_WORDS];
+    // Segment tree over the granules: leaf HEAP_GRANULES + g holds the length
+    // of the free block starting at granule g (0 if none), and every inner
+    // node i the larger of nodes 2i and 2i + 1. Node 1 is the longest free
+    // block in the heap.
+    uint16_t free_tree[2 * HEAP_GRANULES];
 
     size_t available;
     size_t allocations;
@@ -82,35 +418,625 @@ struct allocator_t {
     size_t l_coalesce;
     size_t r_coalesce;
     size_t lr_coalesce;
+    size_t top_allocations; // Served from the top for a lifetime hint.
+    size_t zeroed_fast; // allocate_zeroed() served without clearing.
+    size_t zeroed_slow; // allocate_zeroed() that had to clear the block.
+    size_t purges;
+    size_t remote_frees; // Frees from threads on another NUMA node.
+    size_t oom_calls;        // Calls to the out-of-memory callback.
+    size_t reserve_releases; // Times the emergency reserve was given up.
+    size_t alloc_failures;   // Allocations that failed in the end.
+    size_t invalid_frees;    // Pointers to deallocate() that were no block.
+    size_t splinters;        // Free blocks under SPLINTER_LENGTH split off.
+    size_t splinters_reused; // Allocations served from such a block.
+    size_t line_straddles; // Requests of up to CACHE_LINE bytes split by one.
+    // State of the current window of the adaptive split threshold: its
+    // allocations, how many were short enough to have used a splinter, and
+    // the splinter counts at its start.
+    uint16_t split_window;
+    uint16_t split_small;
+    size_t split_base_splinters;
+    size_t split_base_reused;
+    // Batches taken from another thread cache, and attempts that found none.
+    atomic_size_t steals;
+    atomic_size_t steal_failures;
+    // Requests by padded block length / HEAP_ALIGN (before class rounding).
+    uint32_t size_hist[HEAP_GRANULES];
+    // Size class of the blocks carved for the thread caches, by granule, so
+    // that they can be cached again without reading their tags; every other
+    // granule is SIZE_CLASS_NONE.
+    uint8_t block_class[HEAP_GRANULES];
 };
 
 typedef struct allocator_t allocator_t;
 
-void allocator_reset(allocator_t *alloc) {
+static inline uint16_t granule(allocator_t *alloc, uint8_t *ptr) {
+    return (ptr - alloc->heap) / HEAP_ALIGN;
+}
+
+// Set the leaf of granule g in free_tree to length and update the nodes above
+// it, stopping early once a node is unchanged.
+static inline void free_tree_set(allocator_t *alloc, uint16_t g,
+                                 uint16_t length) {
+    uint16_t *tree = alloc->free_tree;
+    unsigned i = HEAP_GRANULES + g;
+
+    tree[i] = length;
+    for (i /= 2; 0 < i; i /= 2) {
+        uint16_t max = tree[2 * i] < tree[2 * i + 1] ? tree[2 * i + 1]
+                                                     : tree[2 * i];
+        if (tree[i] == max) {
+            break;
+        }
+        tree[i] = max;
+    }
+}
+
+// Record that a free block starts at ptr; its header must be written already.
+static inline void track_free(allocator_t *alloc, uint8_t *ptr) {
+    uint16_t g = granule(alloc, ptr);
+    alloc->free_map[g / 64] |= (uint64_t)1 << (g % 64);
+    free_tree_set(alloc, g, raw_length(*raw_at(ptr)));
+}
+
+// Record that the free block at ptr is gone (allocated or coalesced away).
+static inline void untrack_free(allocator_t *alloc, uint8_t *ptr) {
+    uint16_t g = granule(alloc, ptr);
+    alloc->free_map[g / 64] &= ~((uint64_t)1 << (g % 64));
+    free_tree_set(alloc, g, 0);
+}
+
+static inline bool is_tracked_free(allocator_t *alloc, uint8_t *ptr) {
+    uint16_t g = granule(alloc, ptr);
+    return (alloc->free_map[g / 64] >> (g % 64)) & 1;
+}
+
+// Same as the above, for allocated blocks in alloc_map.
+static inline void track_alloc(allocator_t *alloc, uint8_t *ptr) {
+    uint16_t g = granule(alloc, ptr);
+    alloc->alloc_map[g / 64] |= (uint64_t)1 << (g % 64);
+}
+
+static inline void untrack_alloc(allocator_t *alloc, uint8_t *ptr) {
+    uint16_t g = granule(alloc, ptr);
+    alloc->alloc_map[g / 64] &= ~((uint64_t)1 << (g % 64));
+}
+
+static inline bool is_tracked_alloc(allocator_t *alloc, uint8_t *ptr) {
+    uint16_t g = granule(alloc, ptr);
+    return (alloc->alloc_map[g / 64] >> (g % 64)) & 1;
+}
+
+// Predecessors of granule g at every level of the index.
+static void index_find(free_index_t *index, uint16_t g,
+                       uint16_t preds[SKIP_LEVELS]) {
+    uint16_t x = SKIP_HEAD;
+
+    for (int l = SKIP_LEVELS - 1; 0 <= l; l--) {
+        while (index->next[l][x] != SKIP_NIL && index->next[l][x] < g) {
+            x = index->next[l][x];
+        }
+        preds[l] = x;
+    }
+}
+
+// Recompute span_max[l][x] from the spans one level down.
+static void index_span(free_index_t *index, int l, uint16_t x) {
+    uint16_t max = 0;
+
+    for (uint16_t y = x; y != index->next[l][x]; y = index->next[l - 1][y]) {
+        if (max < index->span_max[l - 1][y]) {
+            max = index->span_max[l - 1][y];
+        }
+    }
+    index->span_max[l][x] = max;
+}
+
+// Recompute the spans holding granule g, bottom up, after g was linked in,
+// unlinked or resized; preds are its predecessors from index_find().
+static void index_repair(free_index_t *index, uint16_t g,
+                         uint16_t preds[SKIP_LEVELS]) {
+    if (index->height[g] != 0) {
+        index->span_max[0][g] = index->length[g];
+    }
+    for (int l = 1; l < SKIP_LEVELS; l++) {
+        index_span(index, l, preds[l]);
+        if (l < index->height[g]) {
+            index_span(index, l, g);
+        }
+    }
+}
+
+// Link a free block of length bytes at granule g in between pred and its
+// successor, at level 0 only.
+static void index_link(free_index_t *index, uint16_t pred, uint16_t g,
+                       uint16_t length) {
+    uint16_t next = index->next[0][pred];
+
+    index->next[0][g] = next;
+    index->next[0][pred] = g;
+    index->prev[g] = pred;
+    if (next != SKIP_NIL) {
+        index->prev[next] = g;
+    }
+    index->height[g] = 1;
+    index->length[g] = length;
+}
+
+// Put the free block at granule g in the place of the one at old, tower and
+// all; only valid if no other free block lies between the two. The one search
+// for old's predecessors serves both to unlink it and to repair the spans, so
+// this costs as much as a removal, with no search of its own for g.
+static void index_replace(free_index_t *index, uint16_t old, uint16_t g,
+                          uint16_t length) {
+    uint16_t preds[SKIP_LEVELS];
+    index_find(index, old, preds);
+
+    index_link(index, preds[0], g, length);
+    index->next[0][g] = index->next[0][old];
+    if (index->next[0][g] != SKIP_NIL) {
+        index->prev[index->next[0][g]] = g;
+    }
+    for (int l = 1; l < index->height[old]; l++) {
+        index->next[l][g] = index->next[l][old];
+        index->next[l][preds[l]] = g;
+    }
+    index->height[g] = index->height[old];
+    index->height[old] = 0;
+    index_repair(index, g, preds);
+    index->neighbour_inserts++;
+}
+
+// Link the free block at granule g in wherever it belongs, searching the skip
+// list for its predecessors.
+static void index_insert(free_index_t *index, uint16_t g, uint16_t length) {
+    uint16_t preds[SKIP_LEVELS];
+    index_find(index, g, preds);
+
+    // Each level up with probability 1/4.
+    index->seed ^= index->seed << 13;
+    index->seed ^= index->seed >> 17;
+    index->seed ^= index->seed << 5;
+    int height = 1;
+    for (uint32_t bits = index->seed; height < SKIP_LEVELS && (bits & 3) == 0;
+         bits >>= 2) {
+        height++;
+    }
+
+    index_link(index, preds[0], g, length);
+    for (int l = 1; l < height; l++) {
+        index->next[l][g] = index->next[l][preds[l]];
+        index->next[l][preds[l]] = g;
+    }
+    index->height[g] = height;
+    index_repair(index, g, preds);
+    index->searched_inserts++;
+}
+
+// Unlink the free block at granule g.
+static void index_remove(free_index_t *index, uint16_t g) {
+    uint16_t preds[SKIP_LEVELS];
+    index_find(index, g, preds);
+
+    for (int l = 1; l < index->height[g]; l++) {
+        index->next[l][preds[l]] = index->next[l][g];
+    }
+    uint16_t prev = index->prev[g];
+    uint16_t next = index->next[0][g];
+    index->next[0][prev] = next;
+    if (next != SKIP_NIL) {
+        index->prev[next] = prev;
+    }
+    index->height[g] = 0;
+    index_repair(index, g, preds);
+}
+
+// The free block at granule g grew or shrank in place.
+static void index_resize(free_index_t *index, uint16_t g, uint16_t length) {
+    uint16_t preds[SKIP_LEVELS];
+
+    index->length[g] = length;
+    index_find(index, g, preds);
+    index_repair(index, g, preds);
+}
+
+// First fit: the lowest free block of at least length bytes, or SKIP_NIL. Each
+// level skips the spans with nothing long enough and descends into the first
+// one that has, in O(log n) expected.
+static uint16_t index_fit(free_index_t *index, uint16_t length) {
+    uint16_t x = SKIP_HEAD;
+
+    for (int l = SKIP_LEVELS - 1; 0 <= l; l--) {
+        while (index->span_max[l][x] < length) {
+            x = index->next[l][x];
+            if (x == SKIP_NIL) {
+                return SKIP_NIL;
+            }
+        }
+    }
+    return x;
+}
+
+// Index the free blocks in free_map from scratch.
+static void index_build(allocator_t *alloc) {
+    free_index_t *index = alloc->index;
+
+    for (int l = 0; l < SKIP_LEVELS; l++) {
+        index->next[l][SKIP_HEAD] = SKIP_NIL;
+        index->span_max[l][SKIP_HEAD] = 0;
+    }
+    index->height[SKIP_HEAD] = SKIP_LEVELS;
+    index->length[SKIP_HEAD] = 0;
+    for (uint16_t g = 0; g < HEAP_GRANULES; g++) {
+        if ((alloc->free_map[g / 64] >> (g % 64)) & 1) {
+            uint8_t *block = alloc->heap + g * HEAP_ALIGN;
+            index_insert(index, g, raw_length(*raw_at(block)));
+        }
+    }
+}
+
+// Whether an allocated block starts at block, for any address: a block start
+// is granule aligned, inside the heap (but not the epilogue) and in alloc_map.
+static inline bool is_block_start(allocator_t *alloc, uint8_t *block) {
+    uintptr_t offset = (uintptr_t)block - (uintptr_t)alloc->heap;
+
+    return offset < (uintptr_t)(HEAP_SIZE - HEAP_ALIGN) &&
+           offset % HEAP_ALIGN == 0 && is_tracked_alloc(alloc, block);
+}
+
+// Mask of the bits of word w covering granules [first, last).
+static inline uint64_t map_mask(uint16_t w, uint16_t first, uint16_t last) {
+    uint16_t lo = first <= w * 64 ? 0 : first - w * 64;
+    uint16_t hi = (w + 1) * 64 <= last ? 64 : last - w * 64;
+    uint64_t mask = hi == 64 ? ~(uint64_t)0 : ((uint64_t)1 << hi) - 1;
+    return mask & ~(((uint64_t)1 << lo) - 1);
+}
+
+// Forget that the granules of the block at ptr are zero.
+static void mark_dirty(allocator_t *alloc, uint8_t *ptr, uint16_t length) {
+    uint16_t first = granule(alloc, ptr);
+    uint16_t last = first + length / HEAP_ALIGN;
+
+    for (uint16_t w = first / 64; w * 64 < last; w++) {
+        alloc->zero_map[w] &= ~map_mask(w, first, last);
+    }
+}
+
+static bool is_clean(allocator_t *alloc, uint8_t *ptr, uint16_t length) {
+    uint16_t first = granule(alloc, ptr);
+    uint16_t last = first + length / HEAP_ALIGN;
+
+    for (uint16_t w = first / 64; w * 64 < last; w++) {
+        uint64_t mask = map_mask(w, first, last);
+        if ((alloc->zero_map[w] & mask) != mask) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Page map: the heap owning any address, as a three-level radix tree over the
+// page numbers of a 48-bit address space, as in tcmalloc. Lookups take no lock;
+// only adding nodes does. Entries point at the allocator_t, so it must not
+// move while its heap is mapped.
+#define PAGEMAP_PAGE_SHIFT 12
+#define PAGEMAP_BITS 12 // Per level.
+#define PAGEMAP_FANOUT (1 << PAGEMAP_BITS)
+
+struct pagemap_leaf_t {
+    _Atomic(allocator_t *) owner[PAGEMAP_FANOUT];
+};
+
+struct pagemap_node_t {
+    _Atomic(struct pagemap_leaf_t *) leaves[PAGEMAP_FANOUT];
+};
+
+static _Atomic(struct pagemap_node_t *) pagemap_root[PAGEMAP_FANOUT];
+static pthread_mutex_t pagemap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The slot for the page of ptr, or NULL if ptr is beyond 48 bits or (unless
+// create) its nodes do not exist yet.
+static _Atomic(allocator_t *) *pagemap_slot(const void *ptr, bool create) {
+    uintptr_t page = (uintptr_t)ptr >> PAGEMAP_PAGE_SHIFT;
+
+    if (page >> (3 * PAGEMAP_BITS) != 0) {
+        return NULL;
+    }
+
+    _Atomic(struct pagemap_node_t *) *root =
+        &pagemap_root[page >> (2 * PAGEMAP_BITS)];
+    struct pagemap_node_t *node = atomic_load(root);
+    if (node == NULL && create) {
+        pthread_mutex_lock(&pagemap_lock);
+        if ((node = atomic_load(root)) == NULL &&
+            (node = calloc(1, sizeof(struct pagemap_node_t))) != NULL) {
+            atomic_store(root, node);
+        }
+        pthread_mutex_unlock(&pagemap_lock);
+    }
+    if (node == NULL) {
+        return NULL;
+    }
+
+    _Atomic(struct pagemap_leaf_t *) *middle =
+        &node->leaves[(page >> PAGEMAP_BITS) & (PAGEMAP_FANOUT - 1)];
+    struct pagemap_leaf_t *leaf = atomic_load(middle);
+    if (leaf == NULL && create) {
+        pthread_mutex_lock(&pagemap_lock);
+        if ((leaf = atomic_load(middle)) == NULL &&
+            (leaf = calloc(1, sizeof(struct pagemap_leaf_t))) != NULL) {
+            atomic_store(middle, leaf);
+        }
+        pthread_mutex_unlock(&pagemap_lock);
+    }
+    if (leaf == NULL) {
+        return NULL;
+    }
+
+    return &leaf->owner[page & (PAGEMAP_FANOUT - 1)];
+}
+
+// Record owner (NULL to forget) for every page of the heap; fails only if a
+// node cannot be allocated.
+static bool pagemap_set(uint8_t *heap, allocator_t *owner) {
+    for (uint8_t *page = heap; page < heap + HEAP_SIZE;
+         page += 1 << PAGEMAP_PAGE_SHIFT) {
+        _Atomic(allocator_t *) *slot = pagemap_slot(page, owner != NULL);
+        if (slot == NULL) {
+            return owner == NULL;
+        }
+        atomic_store(slot, owner);
+    }
+
+    return true;
+}
+
+// The allocator whose heap contains ptr, or NULL for any other address.
+allocator_t *pagemap_lookup(const void *ptr) {
+    _Atomic(allocator_t *) *slot = pagemap_slot(ptr, false);
+    return slot == NULL ? NULL : atomic_load(slot);
+}
+
+// Write the tags of an empty heap and clear the maps and statistics.
+static void heap_format(allocator_t *alloc) {
     boundary_t boundary = {
         .length = HEAP_SIZE - HEAP_ALIGN, .p_alloc = true, .alloc = false};
     put_boundaries(alloc->heap, boundary);
+    memset(alloc->free_map, 0, sizeof(alloc->free_map));
+    memset(alloc->zero_map, 0, sizeof(alloc->zero_map));
+    memset(alloc->alloc_map, 0, sizeof(alloc->alloc_map));
+    memset(alloc->free_tree, 0, sizeof(alloc->free_tree));
+    track_free(alloc, alloc->heap);
+    if (alloc->index != NULL) {
+        index_build(alloc);
+    }
     boundary_t epi_boundary = {
         .length = HEAP_ALIGN, .p_alloc = false, .alloc = true};
     put_boundaries(alloc->heap + (HEAP_SIZE - HEAP_ALIGN), epi_boundary);
     alloc->allocations = alloc->deallocations = alloc->l_coalesce =
         alloc->r_coalesce = alloc->lr_coalesce = 0;
+    alloc->zeroed_fast = alloc->zeroed_slow = alloc->purges = 0;
+    alloc->top_allocations = alloc->remote_frees = 0;
+    alloc->oom_calls = alloc->reserve_releases = alloc->alloc_failures = 0;
+    alloc->invalid_frees = alloc->splinters = alloc->splinters_reused = 0;
+    alloc->line_straddles = 0;
+    alloc->split_window = alloc->split_small = 0;
+    alloc->split_base_splinters = alloc->split_base_reused = 0;
+    // The reserve goes with the rest of the heap.
+    alloc->reserve = NULL;
+    atomic_store(&alloc->steals, 0);
+    atomic_store(&alloc->steal_failures, 0);
     alloc->available = HEAP_SIZE - HEAP_ALIGN;
+    memset(alloc->size_hist, 0, sizeof(alloc->size_hist));
+    memset(alloc->block_class, SIZE_CLASS_NONE, sizeof(alloc->block_class));
+    alloc->formatted = true;
+}
+
+void allocator_reset(allocator_t *alloc) {
+    // The arena goes with the rest of the heap, and so do the runs and the
+    // tenants' blocks.
+    free(alloc->predict);
+    alloc->predict = NULL;
+    free(alloc->runs);
+    alloc->runs = NULL;
+    free(alloc->tenants);
+    alloc->tenants = NULL;
+    heap_format(alloc);
+}
+
+// Format a heap that was set up lazily, on its first use. Everything that
+// looks at the heap or its maps goes through this.
+static inline void heap_ready(allocator_t *alloc) {
+    if (alloc->formatted) {
+        return;
+    }
+
+    bool fresh = alloc->fresh;
+    heap_format(alloc);
+    if (fresh) {
+        memset(alloc->zero_map, 0xff, sizeof(alloc->zero_map));
+    }
+    alloc->fresh = false;
 }
 
-void allocator_init(allocator_t *alloc) {
+// Everything but the heap and the state allocator_reset() sets up.
+static void allocator_defaults(allocator_t *alloc) {
+    alloc->scan = SCAN_IMPLICIT;
+    alloc->size_classes = false;
+    alloc->invalid_free = FREE_LOG;
+    // Split off anything that can hold a free block's boundary tags.
+    alloc->split_threshold = HEAP_ALIGN;
+    alloc->split_adaptive = false;
+    alloc->line_aware = false;
+    alloc->trace = NULL;
+    alloc->predict = NULL;
+    alloc->runs = NULL;
+    alloc->deferred = NULL;
+    alloc->epoch = NULL;
+    alloc->oom = NULL;
+    alloc->oom_arg = NULL;
+    alloc->tenants = NULL;
+    alloc->index = NULL;
+    // Read by allocator_reserve() before anything formats a lazy heap.
+    alloc->reserve = NULL;
+    pthread_mutex_init(&alloc->lock, NULL);
+}
+
+// Returns false, with errno set, if the heap cannot be mapped.
+bool allocator_init(allocator_t *alloc) {
     alloc->heap = Mmap(HEAP_SIZE);
+    if (alloc->heap == NULL) {
+        return false;
+    }
+    if (!pagemap_set(alloc->heap, alloc)) {
+        Munmap(alloc->heap, HEAP_SIZE);
+        errno = ENOMEM;
+        return false;
+    }
+    alloc->mapped = true;
+    alloc->region = NULL;
+    allocator_defaults(alloc);
     allocator_reset(alloc);
+    // Fresh anonymous memory reads as zero.
+    memset(alloc->zero_map, 0xff, sizeof(alloc->zero_map));
+    return true;
+}
+
+// Set up a heap in the HEAP_SIZE bytes at heap without touching them: its
+// boundary tags and maps are only written on first use, by heap_ready().
+static bool allocator_init_lazy(allocator_t *alloc, uint8_t *heap,
+                                bool fresh) {
+    if (!pagemap_set(heap, alloc)) {
+        errno = ENOMEM;
+        return false;
+    }
+    alloc->heap = heap;
+    alloc->mapped = false;
+    alloc->region = NULL;
+    alloc->formatted = false;
+    alloc->fresh = fresh;
+    allocator_defaults(alloc);
+    return true;
+}
+
+// Use the caller's memory as the heap, which must be aligned to HEAP_SIZE and
+// at least that long (anything beyond is not used). No system call is made,
+// and the memory is only written on first use; it stays the caller's to free
+// after allocator_deinit(). Returns false, with errno set, otherwise.
+bool allocator_init_with_buffer(allocator_t *alloc, void *buf, size_t len) {
+    if (buf == NULL || (uintptr_t)buf % HEAP_SIZE != 0 || len < HEAP_SIZE) {
+        errno = EINVAL;
+        return false;
+    }
+
+    return allocator_init_lazy(alloc, buf, false);
+}
+
+// Many heaps carved from one shared mapping, so that setting one up takes no
+// system call. Heaps given back are kept on a list threaded through their
+// first bytes and handed out again.
+struct heap_region_t {
+    uint8_t *base;
+    size_t heaps;
+    atomic_size_t next; // Heaps from here on were never handed out.
+    pthread_mutex_t lock; // Around returned.
+    uint8_t *returned;
+};
+
+typedef struct heap_region_t heap_region_t;
+
+// Map room for heaps heaps at once; returns false, with errno set, if the
+// mapping fails.
+bool heap_region_init(heap_region_t *region, size_t heaps) {
+    region->base = Mmap(heaps * HEAP_SIZE);
+    if (region->base == NULL) {
+        return false;
+    }
+    region->heaps = heaps;
+    atomic_init(&region->next, 0);
+    pthread_mutex_init(&region->lock, NULL);
+    region->returned = NULL;
+    return true;
+}
+
+// Unmap the region; every allocator carved from it must be deinitialised.
+void heap_region_deinit(heap_region_t *region) {
+    Munmap(region->base, region->heaps * HEAP_SIZE);
+    pthread_mutex_destroy(&region->lock);
+}
+
+// A heap never handed out before, which is still zero, or else a returned one.
+static uint8_t *heap_region_get(heap_region_t *region, bool *fresh) {
+    size_t next = atomic_fetch_add(&region->next, 1);
+    if (next < region->heaps) {
+        *fresh = true;
+        return region->base + next * HEAP_SIZE;
+    }
+
+    pthread_mutex_lock(&region->lock);
+    uint8_t *heap = region->returned;
+    if (heap != NULL) {
+        memcpy(&region->returned, heap, sizeof(uint8_t *));
+    }
+    pthread_mutex_unlock(&region->lock);
+    *fresh = false;
+    return heap;
 }
 
+static void heap_region_put(heap_region_t *region, uint8_t *heap) {
+    pthread_mutex_lock(&region->lock);
+    memcpy(heap, &region->returned, sizeof(uint8_t *));
+    region->returned = heap;
+    pthread_mutex_unlock(&region->lock);
+}
+
+// Take the heap from region; it is only formatted on first use. Returns
+// false, with errno set, once every heap in the region is in use.
+bool allocator_init_from(allocator_t *alloc, heap_region_t *region) {
+    bool fresh;
+    uint8_t *heap = heap_region_get(region, &fresh);
+
+    if (heap == NULL) {
+        errno = ENOMEM;
+        return false;
+    }
+    if (!allocator_init_lazy(alloc, heap, fresh)) {
+        heap_region_put(region, heap);
+        return false;
+    }
+    alloc->region = region;
+    return true;
+}
+
+void allocator_async_stop(allocator_t *alloc);
+void allocator_epoch_disable(allocator_t *alloc);
+
 void allocator_deinit(allocator_t *alloc) {
-    Munmap(alloc->heap, HEAP_SIZE);
+    allocator_async_stop(alloc);
+    allocator_epoch_disable(alloc);
+    free(alloc->tenants);
+    alloc->tenants = NULL;
+    free(alloc->index);
+    alloc->index = NULL;
+    pagemap_set(alloc->heap, NULL);
+    if (alloc->mapped) {
+        Munmap(alloc->heap, HEAP_SIZE);
+    } else if (alloc->region != NULL) {
+        heap_region_put(alloc->region, alloc->heap);
+    }
+    pthread_mutex_destroy(&alloc->lock);
+    free(alloc->predict);
+    alloc->predict = NULL;
+    free(alloc->runs);
+    alloc->runs = NULL;
     alloc->allocations = alloc->deallocations = alloc->l_coalesce =
         alloc->r_coalesce = alloc->lr_coalesce = 0;
     alloc->available = HEAP_SIZE - HEAP_ALIGN;
 }
 
 void allocator_dump(allocator_t *alloc) {
+    heap_ready(alloc);
     uint8_t *current = alloc->heap;
     uint16_t block = 0;
 
@@ -131,8 +1057,100 @@ void allocator_dump(allocator_t *alloc) {
     printf("===================================================\n\n");
 }
 
+// The longest request allocate() can serve right now (before size classes), or
+// 0 if the heap is full; read off the root of free_tree. A heap not yet
+// formatted is left as it is, as one free block.
+uint16_t allocator_largest_free(allocator_t *alloc) {
+    if (!alloc->formatted) {
+        return HEAP_SIZE - HEAP_ALIGN - sizeof(raw_boundary_t);
+    }
+    uint16_t length = alloc->free_tree[1];
+    return length == 0 ? 0 : length - sizeof(raw_boundary_t);
+}
+
+// Write the statistics as "<name> <value>" lines, followed by the request
+// histogram as "h <block length> <count>" lines (the format sizeclass_gen
+// reads).
+void allocator_stats_dump(allocator_t *alloc, FILE *out) {
+    heap_ready(alloc);
+    fprintf(out, "available %zu\n", alloc->available);
+    fprintf(out, "allocations %zu\n", alloc->allocations);
+    fprintf(out, "deallocations %zu\n", alloc->deallocations);
+    fprintf(out, "l_coalesce %zu\n", alloc->l_coalesce);
+    fprintf(out, "r_coalesce %zu\n", alloc->r_coalesce);
+    fprintf(out, "lr_coalesce %zu\n", alloc->lr_coalesce);
+    fprintf(out, "top_allocations %zu\n", alloc->top_allocations);
+    fprintf(out, "zeroed_fast %zu\n", alloc->zeroed_fast);
+    fprintf(out, "zeroed_slow %zu\n", alloc->zeroed_slow);
+    fprintf(out, "purges %zu\n", alloc->purges);
+    fprintf(out, "remote_frees %zu\n", alloc->remote_frees);
+    fprintf(out, "oom_calls %zu\n", alloc->oom_calls);
+    fprintf(out, "reserve_releases %zu\n", alloc->reserve_releases);
+    fprintf(out, "alloc_failures %zu\n", alloc->alloc_failures);
+    fprintf(out, "invalid_frees %zu\n", alloc->invalid_frees);
+    fprintf(out, "splinters %zu\n", alloc->splinters);
+    fprintf(out, "splinters_reused %zu\n", alloc->splinters_reused);
+    fprintf(out, "split_threshold %u\n", alloc->split_threshold);
+    fprintf(out, "line_straddles %zu\n", alloc->line_straddles);
+    fprintf(out, "largest_free %u\n", allocator_largest_free(alloc));
+    if (alloc->index != NULL) {
+        fprintf(out, "index_neighbour_inserts %zu\n",
+                alloc->index->neighbour_inserts);
+        fprintf(out, "index_searched_inserts %zu\n",
+                alloc->index->searched_inserts);
+    }
+    if (alloc->tenants != NULL) {
+        for (int t = 0; t < TENANT_MAX; t++) {
+            tenant_t *tenant = &alloc->tenants->tenants[t];
+            if (tenant_total(tenant) == 0 &&
+                atomic_load(&tenant->hard_failures) == 0 &&
+                atomic_load(&tenant->soft_trims) == 0) {
+                continue;
+            }
+            fprintf(out, "tenant_%d_usage %ld\n", t, tenant_total(tenant));
+            fprintf(out, "tenant_%d_hard_failures %zu\n", t,
+                    atomic_load(&tenant->hard_failures));
+            fprintf(out, "tenant_%d_soft_trims %zu\n", t,
+                    atomic_load(&tenant->soft_trims));
+        }
+    }
+    fprintf(out, "steals %zu\n", atomic_load(&alloc->steals));
+    fprintf(out, "steal_failures %zu\n", atomic_load(&alloc->steal_failures));
+    if (alloc->deferred != NULL) {
+        fprintf(out, "async_batches %zu\n", alloc->deferred->batches);
+        fprintf(out, "async_frees %zu\n", alloc->deferred->frees);
+        fprintf(out, "async_overflows %zu\n",
+                atomic_load(&alloc->deferred->overflows));
+    }
+    if (alloc->epoch != NULL) {
+        fprintf(out, "epoch_retired %zu\n",
+                atomic_load(&alloc->epoch->retired));
+        fprintf(out, "epoch_reclaimed %zu\n",
+                atomic_load(&alloc->epoch->reclaimed));
+        fprintf(out, "epoch_advances %zu\n",
+                atomic_load(&alloc->epoch->advances));
+    }
+    if (alloc->predict != NULL) {
+        fprintf(out, "arena_allocations %zu\n",
+                alloc->predict->arena_allocations);
+        fprintf(out, "arena_resets %zu\n", alloc->predict->arena_resets);
+        fprintf(out, "arena_full %zu\n", alloc->predict->arena_full);
+    }
+    if (alloc->runs != NULL) {
+        fprintf(out, "run_allocations %zu\n", alloc->runs->run_allocations);
+        fprintf(out, "runs_claimed %zu\n", alloc->runs->runs_claimed);
+    }
+
+    for (uint16_t g = 1; g < HEAP_GRANULES; g++) {
+        if (alloc->size_hist[g] != 0) {
+            fprintf(out, "h %u %u\n", g * HEAP_ALIGN, alloc->size_hist[g]);
+        }
+    }
+}
+
 // Check integrity of heap.
 void allocator_check(allocator_t *alloc) {
+    heap_ready(alloc);
     uint8_t *current = alloc->heap;
     bool p_alloc = true;
 
@@ -142,6 +1160,12 @@ void allocator_check(allocator_t *alloc) {
         assert(boundary.length != 0);
         assert(boundary.length % HEAP_ALIGN == 0);
         assert(boundary.p_alloc == p_alloc);
+        // free_map mirrors the free blocks and alloc_map the allocated ones
+        // (the epilogue is in neither).
+        assert(is_tracked_free(alloc, current) == !boundary.alloc);
+        assert(is_tracked_alloc(alloc, current) ==
+               (boundary.alloc &&
+                current != alloc->heap + (HEAP_SIZE - HEAP_ALIGN)));
         if (!boundary.alloc) {
             raw_boundary_t header = *boundary_ptr;
             raw_boundary_t footer =
@@ -158,17 +1182,75 @@ void allocator_check(allocator_t *alloc) {
     boundary_t epi_boundary = unpack(*epi_boundary_ptr);
     assert(epi_boundary.length == HEAP_ALIGN);
     assert(epi_boundary.alloc); // Check that epilogue block is valid.
-}
 
-uint16_t padding(uint16_t length) {
-    if (length % HEAP_ALIGN == 0) {
-        return 0;
+    // Only allocated blocks of exactly their class length have a class.
+    for (uint16_t g = 0; g < HEAP_GRANULES; g++) {
+        uint8_t class = alloc->block_class[g];
+        uint8_t *block = alloc->heap + g * HEAP_ALIGN;
+        assert(class == SIZE_CLASS_NONE ||
+               (is_tracked_alloc(alloc, block) &&
+                raw_length(*raw_at(block)) == SIZE_CLASS_LENGTH[class]));
     }
 
-    return HEAP_ALIGN - (length % HEAP_ALIGN);
-}
-
-uint16_t pad_length(uint16_t length) { return length + padding(length); }
+    // free_tree holds the length of every free block, and the maximum of its
+    // children at every inner node.
+    for (uint16_t g = 0; g < HEAP_GRANULES; g++) {
+        uint8_t *block = alloc->heap + g * HEAP_ALIGN;
+        uint16_t length =
+            is_tracked_free(alloc, block) ? raw_length(*raw_at(block)) : 0;
+        assert(alloc->free_tree[HEAP_GRANULES + g] == length);
+    }
+    for (unsigned i = HEAP_GRANULES - 1; 0 < i; i--) {
+        uint16_t left = alloc->free_tree[2 * i];
+        uint16_t right = alloc->free_tree[2 * i + 1];
+        assert(alloc->free_tree[i] == (left < right ? right : left));
+    }
+
+    // The index lists exactly the free blocks, in address order, on every
+    // level.
+    if (alloc->index != NULL) {
+        free_index_t *index = alloc->index;
+        uint16_t x = SKIP_HEAD;
+        for (uint16_t g = 0; g < HEAP_GRANULES; g++) {
+            uint8_t *block = alloc->heap + g * HEAP_ALIGN;
+            if (is_tracked_free(alloc, block)) {
+                assert(index->next[0][x] == g);
+                assert(index->prev[g] == x);
+                assert(index->length[g] == raw_length(*raw_at(block)));
+                assert(index->span_max[0][g] == index->length[g]);
+                x = g;
+            }
+        }
+        assert(index->next[0][x] == SKIP_NIL);
+        for (int l = 1; l < SKIP_LEVELS; l++) {
+            for (x = SKIP_HEAD; x != SKIP_NIL; x = index->next[l][x]) {
+                uint16_t next = index->next[l][x];
+                assert(next == SKIP_NIL || x == SKIP_HEAD || x < next);
+                assert(next == SKIP_NIL || l < index->height[next]);
+                uint16_t max = 0;
+                for (uint16_t y = x; y != next; y = index->next[0][y]) {
+                    if (max < index->length[y]) {
+                        max = index->length[y];
+                    }
+                }
+                assert(index->span_max[l][x] == max);
+            }
+        }
+    }
+}
+
+uint16_t padding(uint16_t length) {
+    if (length % HEAP_ALIGN == 0) {
+        return 0;
+    }
+
+    return HEAP_ALIGN - (length % HEAP_ALIGN);
+}
+
+// Same as length + padding(length), without the branch.
+uint16_t pad_length(uint16_t length) {
+    return (length + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+}
 
 void update_p_alloc(allocator_t *alloc, uint8_t *ptr, boundary_t boundary) {
     // Do not update if ptr is the last block
@@ -176,275 +1258,4398 @@ void update_p_alloc(allocator_t *alloc, uint8_t *ptr, boundary_t boundary) {
         return;
     }
 
-    raw_boundary_t *n_boundary_ptr =
-        (raw_boundary_t *)((uint8_t *)ptr + boundary.length);
-    boundary_t n_boundary = unpack(*n_boundary_ptr);
-    n_boundary.p_alloc = boundary.alloc;
-    put_boundaries((uint8_t *)n_boundary_ptr, n_boundary);
-}
+    put_p_alloc_raw(ptr + boundary.length, boundary.alloc);
+}
+
+// The shortest rest of a free block worth splitting off. Whatever
+// alloc->split_threshold was set to, a free block needs room for its tags.
+static inline uint16_t split_minimum(allocator_t *alloc) {
+    return alloc->split_threshold < HEAP_ALIGN ? HEAP_ALIGN
+                                               : alloc->split_threshold;
+}
+
+// Allocate length bytes (already padded, boundary included) from the free block
+// at current, splitting off the rest into a new free block when it is big
+// enough.
+static void *place(allocator_t *alloc, uint8_t *current, uint16_t length) {
+    raw_boundary_t raw = *raw_at(current);
+    uint16_t block_length = raw_length(raw);
+
+    untrack_free(alloc, current);
+    if (block_length < SPLINTER_LENGTH) {
+        alloc->splinters_reused++;
+    }
+
+    // Remaining size of block not worth splitting off (at least when it
+    // cannot hold a header and footer; we don't want 0-size free blocks);
+    // just set the alloc bit to true.
+    if (block_length - length < split_minimum(alloc)) {
+        if (alloc->index != NULL) {
+            index_remove(alloc->index, granule(alloc, current));
+        }
+        *raw_at(current) = raw | RAW_ALLOC;
+        // Update p_alloc of next block (status changed to alloc = true). The
+        // next block of a free block is always allocated, so it has no footer.
+        *raw_at(current + block_length) |= RAW_P_ALLOC;
+        track_alloc(alloc, current);
+        alloc->available -= block_length;
+        alloc->allocations++;
+        return current + sizeof(raw_boundary_t);
+    }
+
+    // Split off remaining block into new free block.
+    // Do not have to update next block's p_alloc because it is still free.
+    if (block_length - length < SPLINTER_LENGTH) {
+        alloc->splinters++;
+    }
+    put_free_raw(current + length,
+                 ((block_length - length) << 2) | RAW_P_ALLOC);
+    track_free(alloc, current + length);
+    if (alloc->index != NULL) {
+        // The rest takes the place of the block it was split from.
+        index_replace(alloc->index, granule(alloc, current),
+                      granule(alloc, current + length), block_length - length);
+    }
+
+    // Set header of newly allocated block.
+    *raw_at(current) = (length << 2) | (raw & RAW_P_ALLOC) | RAW_ALLOC;
+    track_alloc(alloc, current);
+    alloc->available -= length;
+    alloc->allocations++;
+    return current + sizeof(raw_boundary_t);
+}
+
+// Iterator over the set bits of free_map, in address order.
+struct map_iter_t {
+    uint16_t word;
+    uint64_t bits;
+};
+
+typedef struct map_iter_t map_iter_t;
+
+// Return the next free granule, or -1 once the map is exhausted.
+static inline int map_next(const uint64_t *map, map_iter_t *it) {
+    while (it->bits == 0) {
+        if (it->word + 1 >= FREE_MAP_WORDS) {
+            return -1;
+        }
+        it->bits = map[++it->word];
+    }
+
+    int bit = __builtin_ctzll(it->bits);
+    it->bits &= it->bits - 1;
+    return it->word * 64 + bit;
+}
+
+// First fit over the free blocks only. The candidates come from free_map rather
+// than from the previous block's length, so their headers do not depend on each
+// other and can be prefetched PREFETCH_DISTANCE candidates ahead of the cursor.
+static uint8_t *find_fit_prefetch(allocator_t *alloc, uint16_t length) {
+    map_iter_t cursor = {.word = 0, .bits = alloc->free_map[0]};
+    map_iter_t lead = cursor;
+
+    for (int i = 0; i < PREFETCH_DISTANCE; i++) {
+        int g = map_next(alloc->free_map, &lead);
+        if (g < 0) {
+            break;
+        }
+        __builtin_prefetch(alloc->heap + g * HEAP_ALIGN);
+    }
+
+    int g;
+    while ((g = map_next(alloc->free_map, &cursor)) >= 0) {
+        int ahead = map_next(alloc->free_map, &lead);
+        if (0 <= ahead) {
+            __builtin_prefetch(alloc->heap + ahead * HEAP_ALIGN);
+        }
+
+        uint8_t *current = alloc->heap + g * HEAP_ALIGN;
+        if (length <= unpack(*((raw_boundary_t *)current)).length) {
+            return current;
+        }
+    }
+
+    return NULL;
+}
+
+// Length of the block for a padded length: that of its size class, if it has
+// one, through the SIZE_CLASS_INDEX table.
+static inline uint16_t size_class_block(uint16_t padded) {
+    uint8_t class = SIZE_CLASS_INDEX[padded / HEAP_ALIGN];
+    return class == SIZE_CLASS_NONE ? padded : SIZE_CLASS_LENGTH[class];
+}
+
+// Round a request up so that its block is exactly the length of its size
+// class; requests above the largest class only fill their padding.
+uint16_t size_class_round(uint16_t length) {
+    return size_class_block(pad_length(length + sizeof(raw_boundary_t))) -
+           sizeof(raw_boundary_t);
+}
+
+// First fit through free_tree: from the root, go left whenever the left half
+// has a block long enough, in log2(HEAP_GRANULES) steps.
+static uint8_t *find_fit_tree(allocator_t *alloc, uint16_t length) {
+    uint16_t *tree = alloc->free_tree;
+
+    if (tree[1] < length) {
+        return NULL;
+    }
+
+    unsigned i = 1;
+    while (i < HEAP_GRANULES) {
+        i = length <= tree[2 * i] ? 2 * i : 2 * i + 1;
+    }
+    return alloc->heap + (i - HEAP_GRANULES) * HEAP_ALIGN;
+}
+
+// First fit for a block of length bytes (already padded, boundary included).
+static void *allocate_fit(allocator_t *alloc, uint16_t length) {
+    if (alloc->scan == SCAN_PREFETCH) {
+        uint8_t *current = find_fit_prefetch(alloc, length);
+        if (current == NULL) {
+            return NULL;
+        }
+        return place(alloc, current, length);
+    }
+
+    if (alloc->scan == SCAN_TREE) {
+        uint8_t *current = find_fit_tree(alloc, length);
+        if (current == NULL) {
+            return NULL;
+        }
+        return place(alloc, current, length);
+    }
+
+    if (alloc->scan == SCAN_ORDERED && alloc->index != NULL) {
+        uint16_t g = index_fit(alloc->index, length);
+        if (g == SKIP_NIL) {
+            return NULL;
+        }
+        return place(alloc, alloc->heap + g * HEAP_ALIGN, length);
+    }
+
+    // Find a free block sufficiently big; length is fixed for the whole walk,
+    // so each block costs one load and a compare.
+    uint8_t *current = alloc->heap;
+
+    while (current < alloc->heap + (HEAP_SIZE - HEAP_ALIGN)) {
+        raw_boundary_t raw = *raw_at(current);
+
+        // Block is free and big enough.
+        if (!(raw & RAW_ALLOC) && length <= raw_length(raw)) {
+            return place(alloc, current, length);
+        }
+
+        // Block allocated or too small; move on.
+        current += raw_length(raw);
+    }
+
+    return NULL;
+}
+
+// Allocate length bytes (already padded, boundary included) from the end of
+// the free block at current, leaving its front free.
+static void *place_top(allocator_t *alloc, uint8_t *current, uint16_t length) {
+    raw_boundary_t raw = *raw_at(current);
+    uint16_t block_length = raw_length(raw);
+
+    // Nothing worth keeping in front; same as taking the block from the start.
+    if (block_length - length < split_minimum(alloc)) {
+        return place(alloc, current, length);
+    }
+    if (block_length < SPLINTER_LENGTH) {
+        alloc->splinters_reused++;
+    }
+    if (block_length - length < SPLINTER_LENGTH) {
+        alloc->splinters++;
+    }
+
+    // The free block stays where it is, only shorter.
+    put_free_raw(current,
+                 ((block_length - length) << 2) | (raw & RAW_P_ALLOC));
+    free_tree_set(alloc, granule(alloc, current), block_length - length);
+    if (alloc->index != NULL) {
+        index_resize(alloc->index, granule(alloc, current),
+                     block_length - length);
+    }
+
+    // The new block follows a free block, and the next block (allocated, as
+    // it follows a free block) now follows an allocated one.
+    uint8_t *block = current + block_length - length;
+    *raw_at(block) = (length << 2) | RAW_ALLOC;
+    *raw_at(block + length) |= RAW_P_ALLOC;
+    track_alloc(alloc, block);
+    alloc->available -= length;
+    alloc->allocations++;
+    return block + sizeof(raw_boundary_t);
+}
+
+// Last fit: the highest free block that is long enough, found by walking
+// free_map from the top.
+static uint8_t *find_fit_top(allocator_t *alloc, uint16_t length) {
+    for (int w = FREE_MAP_WORDS - 1; 0 <= w; w--) {
+        uint64_t bits = alloc->free_map[w];
+
+        while (bits != 0) {
+            int bit = 63 - __builtin_clzll(bits);
+            bits &= ~((uint64_t)1 << bit);
+
+            uint8_t *current = alloc->heap + (w * 64 + bit) * HEAP_ALIGN;
+            if (length <= raw_length(*raw_at(current))) {
+                return current;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Last fit for a block of length bytes (already padded, boundary included).
+static void *allocate_top(allocator_t *alloc, uint16_t length) {
+    uint8_t *current = find_fit_top(alloc, length);
+
+    if (current == NULL) {
+        return NULL;
+    }
+
+    alloc->top_allocations++;
+    return place_top(alloc, current, length);
+}
+
+// Whether length bytes at ptr cross a cache line. Every heap is aligned to
+// HEAP_SIZE, a multiple of CACHE_LINE, so its offsets fall on the same lines as
+// the addresses.
+static inline bool line_straddles(allocator_t *alloc, uint8_t *ptr,
+                                  uint16_t length) {
+    return CACHE_LINE < (ptr - alloc->heap) % CACHE_LINE + length;
+}
+
+// First fit for a block of at most CACHE_LINE bytes whose payload does not
+// straddle a cache line: taken from the front of one of the first LINE_WINDOW
+// free blocks that fit, or carved from its end. Otherwise the first fit.
+static void *allocate_line(allocator_t *alloc, uint16_t length) {
+    uint16_t payload = length - sizeof(raw_boundary_t);
+    map_iter_t cursor = {.word = 0, .bits = alloc->free_map[0]};
+    uint8_t *first = NULL;
+    int g;
+
+    for (int seen = 0;
+         seen < LINE_WINDOW && (g = map_next(alloc->free_map, &cursor)) >= 0;) {
+        uint8_t *current = alloc->heap + g * HEAP_ALIGN;
+        uint16_t block_length = raw_length(*raw_at(current));
+        if (block_length < length) {
+            continue;
+        }
+        seen++;
+        if (first == NULL) {
+            first = current;
+        }
+
+        if (!line_straddles(alloc, current + sizeof(raw_boundary_t),
+                            payload)) {
+            return place(alloc, current, length);
+        }
+        uint8_t *end = current + block_length - length;
+        if (split_minimum(alloc) <= block_length - length &&
+            !line_straddles(alloc, end + sizeof(raw_boundary_t), payload)) {
+            return place_top(alloc, current, length);
+        }
+    }
+
+    return first == NULL ? NULL : place(alloc, first, length);
+}
+
+// Place a block of length bytes (already padded, boundary included).
+static void *allocate_placed(allocator_t *alloc, uint16_t length,
+                             unsigned flags) {
+    if (flags & (ALLOC_LONG | ALLOC_PERMANENT)) {
+        return allocate_top(alloc, length);
+    }
+    if (alloc->line_aware && length <= CACHE_LINE) {
+        return allocate_line(alloc, length);
+    }
+    return allocate_fit(alloc, length);
+}
+
+void deallocate(allocator_t *alloc, void *ptr);
+
+// The heap is out of room for a block of length bytes: let the application
+// release what it can and retry, and give up the emergency reserve as a last
+// resort.
+static void *allocate_oom(allocator_t *alloc, uint16_t length,
+                          unsigned flags) {
+    void *ptr = NULL;
+
+    for (int i = 0; ptr == NULL && alloc->oom != NULL && i < OOM_RETRIES;
+         i++) {
+        alloc->oom_calls++;
+        if (!alloc->oom(alloc, length, alloc->oom_arg)) {
+            break;
+        }
+        ptr = allocate_placed(alloc, length, flags);
+    }
+
+    if (ptr == NULL && alloc->reserve != NULL) {
+        deallocate(alloc, alloc->reserve);
+        alloc->reserve = NULL;
+        alloc->reserve_releases++;
+        ptr = allocate_placed(alloc, length, flags);
+    }
+
+    if (ptr == NULL) {
+        alloc->alloc_failures++;
+    }
+    return ptr;
+}
+
+// Adaptive split threshold: at the end of every window of SPLIT_WINDOW
+// allocations, raise the threshold if most splinters split off in it were
+// never used again, and lower it if requests short enough to be served from
+// splinters were common.
+static void split_adapt(allocator_t *alloc, uint16_t length) {
+    if (length < alloc->split_threshold) {
+        alloc->split_small++;
+    }
+    if (++alloc->split_window < SPLIT_WINDOW) {
+        return;
+    }
+
+    size_t created = alloc->splinters - alloc->split_base_splinters;
+    size_t reused = alloc->splinters_reused - alloc->split_base_reused;
+    if (created != 0 && reused * 4 < created &&
+        alloc->split_threshold < SPLINTER_LENGTH) {
+        alloc->split_threshold += HEAP_ALIGN;
+    } else if (SPLIT_WINDOW / 4 <= alloc->split_small &&
+               HEAP_ALIGN < alloc->split_threshold) {
+        alloc->split_threshold -= HEAP_ALIGN;
+    }
+
+    alloc->split_window = alloc->split_small = 0;
+    alloc->split_base_splinters = alloc->splinters;
+    alloc->split_base_reused = alloc->splinters_reused;
+}
+
+// Allocate with a lifetime hint (alloc_hint_t flags). Long-lived and permanent
+// objects are packed at the top of the heap and everything else at the bottom,
+// so that short-lived objects coalesce back into large free runs instead of
+// being pinned apart by long-lived ones.
+void *allocate_hint(allocator_t *alloc, uint16_t length, unsigned flags) {
+    // Unless positive length, ignore request.
+    if (length == 0) {
+        return NULL;
+    }
+    heap_ready(alloc);
+
+    // Can never fit; rejecting it here also keeps the padded length from
+    // wrapping around.
+    if (HEAP_SIZE - HEAP_ALIGN - sizeof(raw_boundary_t) < length) {
+        return NULL;
+    }
+
+    // Normalised to a block length once, here; everything below takes it as
+    // it is.
+    uint16_t padded = pad_length(length + sizeof(raw_boundary_t));
+    alloc->size_hist[padded / HEAP_ALIGN]++;
+    uint16_t block = alloc->size_classes ? size_class_block(padded) : padded;
+
+    void *ptr = allocate_placed(alloc, block, flags);
+    if (ptr == NULL) {
+        ptr = allocate_oom(alloc, block, flags);
+    }
+    if (alloc->split_adaptive && ptr != NULL) {
+        split_adapt(alloc, block);
+    }
+    if (ptr != NULL && length <= CACHE_LINE &&
+        line_straddles(alloc, ptr, length)) {
+        alloc->line_straddles++;
+    }
+
+    if (alloc->trace != NULL) {
+        fprintf(alloc->trace, "a %u %ld\n", length,
+                ptr == NULL ? -1L : (long)((uint8_t *)ptr - alloc->heap));
+    }
+
+    // Not attributed to a site unless allocate() says otherwise.
+    if (alloc->predict != NULL && ptr != NULL) {
+        uint8_t *block = (uint8_t *)ptr - sizeof(raw_boundary_t);
+        alloc->predict->site_of[granule(alloc, block)] = PREDICT_NO_SITE;
+    }
+
+    return ptr;
+}
+
+// Slot of the call site at address, claiming a free one if it is new.
+static uint8_t predict_site(predictor_t *predict, void *address) {
+    uint32_t hash = (uintptr_t)address * 2654435761u;
+
+    for (int i = 0; i < PREDICT_SITES; i++) {
+        uint8_t slot = (hash + i) % PREDICT_SITES;
+        if (predict->sites[slot].address == address) {
+            return slot;
+        }
+        if (predict->sites[slot].address == NULL) {
+            predict->sites[slot].address = address;
+            return slot;
+        }
+    }
+
+    return PREDICT_NO_SITE;
+}
+
+static void predict_birth(predictor_t *predict, uint16_t g, uint8_t site) {
+    predict->site_of[g] = site;
+    predict->birth[g] = predict->clock++;
+}
+
+static void predict_death(predictor_t *predict, uint16_t g) {
+    uint8_t site = predict->site_of[g];
+    uint32_t lifetime = predict->clock++ - predict->birth[g];
+
+    if (site == PREDICT_NO_SITE) {
+        return;
+    }
+
+    site_t *s = &predict->sites[site];
+    if (s->samples++ == 0) {
+        s->lifetime = lifetime;
+    } else {
+        s->lifetime += ((int64_t)lifetime - s->lifetime) / 8;
+    }
+}
+
+static void *allocate_predicted(allocator_t *alloc, uint16_t length,
+                                void *address) {
+    predictor_t *predict = alloc->predict;
+    uint8_t site = predict_site(predict, address);
+
+    // Can never fit, in the arena or the heap; rejecting it here also keeps
+    // the padded length from wrapping around.
+    if (HEAP_SIZE - HEAP_ALIGN - sizeof(raw_boundary_t) < length) {
+        return NULL;
+    }
+    size_t padded = pad_length(length);
+
+    if (site != PREDICT_NO_SITE && length != 0 &&
+        PREDICT_MIN_SAMPLES <= predict->sites[site].samples &&
+        predict->sites[site].lifetime < PREDICT_SHORT_LIFETIME) {
+        if (padded <= (size_t)(predict->arena_end - predict->bump)) {
+            uint8_t *ptr = predict->bump;
+            predict->bump += padded;
+            uint16_t g = granule(alloc, ptr);
+            predict->arena_map[g / 64] |= (uint64_t)1 << (g % 64);
+            predict->arena_live++;
+            predict->arena_allocations++;
+            predict_birth(predict, granule(alloc, ptr), site);
+            return ptr;
+        }
+        predict->arena_full++;
+    }
+
+    uint8_t *ptr = allocate_hint(alloc, length, 0);
+    if (ptr != NULL) {
+        predict_birth(predict, granule(alloc, ptr - sizeof(raw_boundary_t)),
+                      site);
+    }
+    return ptr;
+}
+
+// Deal with a pointer to deallocate() that is not an allocated block, as
+// alloc->invalid_free says.
+static void reject_free(allocator_t *alloc, void *ptr) {
+    alloc->invalid_frees++;
+    if (alloc->invalid_free == FREE_ABORT) {
+        fprintf(stderr, "Tried to free %p, which is not an allocated block\n",
+                ptr);
+        abort();
+    }
+    if (alloc->invalid_free == FREE_LOG) {
+        DBG("Tried to free %p, which is not an allocated block", ptr);
+    }
+}
+
+// Returns whether ptr came from the arena, and releases it if so. Arena
+// allocations are granule aligned, so arena_map tells which are live.
+static bool deallocate_arena(allocator_t *alloc, uint8_t *ptr) {
+    predictor_t *predict = alloc->predict;
+
+    if (ptr < predict->arena || predict->arena_end <= ptr) {
+        return false;
+    }
+
+    uint16_t g = granule(alloc, ptr);
+    if ((ptr - alloc->heap) % HEAP_ALIGN != 0 ||
+        !((predict->arena_map[g / 64] >> (g % 64)) & 1)) {
+        reject_free(alloc, ptr);
+        return true;
+    }
+
+    predict->arena_map[g / 64] &= ~((uint64_t)1 << (g % 64));
+    predict_death(predict, g);
+    if (--predict->arena_live == 0) {
+        predict->bump = predict->arena;
+        predict->arena_resets++;
+    }
+    return true;
+}
+
+// Give the block of a run back to the heap.
+static void run_free(allocator_t *alloc, run_t *run) {
+    uint8_t *block = run->block;
+
+    run->block = NULL;
+    run->owned = false;
+    deallocate(alloc, block);
+}
+
+// A run for the calling thread: an unused slot with a new block from the
+// heap, or else an empty run, whoever owned it.
+static run_t *run_claim(allocator_t *alloc, pthread_t self) {
+    runs_t *runs = alloc->runs;
+    run_t *run = NULL;
+
+    for (int i = 0; i < RUN_MAX && run == NULL; i++) {
+        if (runs->runs[i].block == NULL) {
+            run = &runs->runs[i];
+        }
+    }
+    if (run != NULL) {
+        // Room for RUN_LENGTH bytes from the first line boundary on.
+        uint8_t *block = allocate_hint(
+            alloc, RUN_LENGTH + CACHE_LINE - sizeof(raw_boundary_t), 0);
+        if (block == NULL) {
+            return NULL;
+        }
+        run->block = block;
+        run->start = (uint8_t *)(((uintptr_t)block + CACHE_LINE - 1) &
+                                 ~(uintptr_t)(CACHE_LINE - 1));
+        run->end = run->start + RUN_LENGTH;
+        runs->runs_claimed++;
+    } else {
+        for (int i = 0; i < RUN_MAX && run == NULL; i++) {
+            if (runs->runs[i].live == 0) {
+                run = &runs->runs[i];
+            }
+        }
+        if (run == NULL) {
+            return NULL;
+        }
+    }
+
+    run->bump = run->start;
+    run->owner = self;
+    run->owned = true;
+    return run;
+}
+
+// Serve a small request from the calling thread's run, retiring the run once
+// it is full; NULL if no run can be had.
+static void *allocate_run(allocator_t *alloc, uint16_t length) {
+    runs_t *runs = alloc->runs;
+    pthread_t self = pthread_self();
+    uint16_t padded = pad_length(length);
+    run_t *run = NULL;
+
+    for (int i = 0; i < RUN_MAX && run == NULL; i++) {
+        if (runs->runs[i].owned &&
+            pthread_equal(runs->runs[i].owner, self)) {
+            run = &runs->runs[i];
+        }
+    }
+
+    if (run != NULL && run->end - run->bump < padded) {
+        run->owned = false;
+        if (run->live == 0) {
+            run_free(alloc, run);
+        }
+        run = NULL;
+    }
+    if (run == NULL && (run = run_claim(alloc, self)) == NULL) {
+        return NULL;
+    }
+
+    uint8_t *ptr = run->bump;
+    run->bump += padded;
+    run->slots |= (uint32_t)1 << ((ptr - run->start) / HEAP_ALIGN);
+    run->live++;
+    runs->run_allocations++;
+    return ptr;
+}
+
+// Returns whether ptr came from a run, and releases it if so.
+static bool deallocate_run(allocator_t *alloc, uint8_t *ptr) {
+    for (int i = 0; i < RUN_MAX; i++) {
+        run_t *run = &alloc->runs->runs[i];
+
+        if (run->block == NULL || ptr < run->start || run->end <= ptr) {
+            continue;
+        }
+
+        uint32_t slot = (uint32_t)1 << ((ptr - run->start) / HEAP_ALIGN);
+        if ((ptr - run->start) % HEAP_ALIGN != 0 || !(run->slots & slot)) {
+            reject_free(alloc, ptr);
+            return true;
+        }
+        run->slots &= ~slot;
+        if (--run->live == 0) {
+            if (run->owned) {
+                run->bump = run->start;
+            } else {
+                run_free(alloc, run);
+            }
+        }
+        return true;
+    }
+
+    return false;
+}
+
+// Add bytes (negative to take them off) to the calling CPU's share of the
+// tenant's usage, folding the share into the total once it has drifted by
+// TENANT_BATCH, so that CPUs rarely write to the same cache line.
+static void tenant_charge(tenant_t *tenant, long bytes) {
+    int cpu = sched_getcpu();
+    struct tenant_cpu_t *share =
+        &tenant->cpus[(cpu < 0 ? 0 : cpu) % TENANT_CPUS];
+    long delta = atomic_fetch_add(&share->delta, bytes) + bytes;
+
+    if (delta <= -TENANT_BATCH || TENANT_BATCH <= delta) {
+        atomic_fetch_add(&tenant->usage, atomic_exchange(&share->delta, 0));
+    }
+}
+
+// Credit the block at block (length bytes) back to the tenant it was charged
+// to, if any.
+static void tenant_release(allocator_t *alloc, uint8_t *block,
+                           uint16_t length) {
+    uint16_t g = granule(alloc, block);
+    uint8_t owner = alloc->tenants->owner[g];
+
+    if (owner != TENANT_NONE) {
+        tenant_charge(&alloc->tenants->tenants[owner], -(long)length);
+        alloc->tenants->owner[g] = TENANT_NONE;
+    }
+}
+
+// Not inlined, so that __builtin_return_address() names the caller's call
+// site.
+__attribute__((noinline)) void *allocate(allocator_t *alloc,
+                                         uint16_t length) {
+    if (alloc->predict != NULL) {
+        return allocate_predicted(alloc, length, __builtin_return_address(0));
+    }
+    if (alloc->runs != NULL && 0 < length && length <= RUN_SMALL) {
+        void *ptr = allocate_run(alloc, length);
+        if (ptr != NULL) {
+            return ptr;
+        }
+    }
+
+    return allocate_hint(alloc, length, 0);
+}
+
+void deallocate(allocator_t *alloc, void *ptr) {
+    // Ignore NULL pointers
+    if (ptr == NULL) {
+        return;
+    }
+    heap_ready(alloc);
+
+    if (alloc->trace != NULL) {
+        fprintf(alloc->trace, "d %ld\n", (long)((uint8_t *)ptr - alloc->heap));
+    }
+
+    if (alloc->predict != NULL && deallocate_arena(alloc, ptr)) {
+        return;
+    }
+    if (alloc->runs != NULL && deallocate_run(alloc, ptr)) {
+        return;
+    }
+
+    raw_boundary_t *boundary_ptr = ptr;
+    boundary_ptr -= 1; // Move back to header.
+
+    // Only free allocated blocks; this catches double frees, interior and
+    // foreign pointers and the epilogue without reading the header.
+    if (!is_block_start(alloc, (uint8_t *)boundary_ptr)) {
+        reject_free(alloc, ptr);
+        return;
+    }
+    untrack_alloc(alloc, (uint8_t *)boundary_ptr);
+    alloc->block_class[granule(alloc, (uint8_t *)boundary_ptr)] =
+        SIZE_CLASS_NONE;
+    boundary_t boundary = unpack(*boundary_ptr);
+
+    if (alloc->predict != NULL) {
+        predict_death(alloc->predict, granule(alloc, (uint8_t *)boundary_ptr));
+    }
+    if (alloc->tenants != NULL) {
+        tenant_release(alloc, (uint8_t *)boundary_ptr, boundary.length);
+    }
+
+    // Whatever the block held, it is not known to be zero any more.
+    mark_dirty(alloc, (uint8_t *)boundary_ptr, boundary.length);
+
+    raw_boundary_t raw = *boundary_ptr;
+    raw_boundary_t *n_boundary_ptr =
+        (raw_boundary_t *)((uint8_t *)boundary_ptr + boundary.length);
+    raw_boundary_t n_raw = *n_boundary_ptr;
+
+    // Both of the adjacent blocks are allocated; no coalescing.
+    if ((raw & RAW_P_ALLOC) && (n_raw & RAW_ALLOC)) {
+        put_free_raw((uint8_t *)boundary_ptr, raw & ~RAW_ALLOC);
+        *n_boundary_ptr = n_raw & ~RAW_P_ALLOC;
+        track_free(alloc, (uint8_t *)boundary_ptr);
+        // No free neighbour to go by.
+        if (alloc->index != NULL) {
+            index_insert(alloc->index, granule(alloc, (uint8_t *)boundary_ptr),
+                         boundary.length);
+        }
+    }
+
+    // The previous block is free but the next allocated; coalescing to the
+    // left.
+    else if (n_raw & RAW_ALLOC) {
+        raw_boundary_t p_raw =
+            *(boundary_ptr - 1); // Footer of previous block (we know it has
+                                 // one because it's free).
+        uint8_t *p_boundary_ptr =
+            (uint8_t *)boundary_ptr -
+            raw_length(p_raw); // Move to header of previous block.
+        boundary.length += raw_length(p_raw);
+        put_free_raw(p_boundary_ptr,
+                     (boundary.length << 2) | (p_raw & RAW_P_ALLOC));
+        *n_boundary_ptr = n_raw & ~RAW_P_ALLOC;
+        free_tree_set(alloc, granule(alloc, p_boundary_ptr), boundary.length);
+        if (alloc->index != NULL) {
+            index_resize(alloc->index, granule(alloc, p_boundary_ptr),
+                         boundary.length);
+        }
+        // The absorbed footer may sit in a granule known to be zero.
+        *(boundary_ptr - 1) = 0;
+        alloc->l_coalesce++;
+    }
+
+    // The previous block is allocated, but the next free; coalescing to the
+    // right.
+    else if (raw & RAW_P_ALLOC) {
+        boundary.length += raw_length(n_raw);
+        put_free_raw((uint8_t *)boundary_ptr,
+                     (boundary.length << 2) | RAW_P_ALLOC);
+        untrack_free(alloc, (uint8_t *)n_boundary_ptr);
+        track_free(alloc, (uint8_t *)boundary_ptr);
+        // The merged block takes the place of the next one in the index.
+        if (alloc->index != NULL) {
+            index_replace(alloc->index,
+                          granule(alloc, (uint8_t *)n_boundary_ptr),
+                          granule(alloc, (uint8_t *)boundary_ptr),
+                          boundary.length);
+        }
+        // The absorbed header may sit in a granule known to be zero.
+        *n_boundary_ptr = 0;
+        // Do not need to update p_block of next block because it hasn't changed
+        // (free -> free).
+        alloc->r_coalesce++;
+    }
+
+    // Both of the adjacent blocks are free; coalescing to both sides.
+    else {
+        raw_boundary_t p_raw =
+            *(boundary_ptr - 1); // Footer of previous block.
+        uint8_t *p_boundary_ptr =
+            (uint8_t *)boundary_ptr -
+            raw_length(p_raw); // Move back to header of previous block.
+        boundary.length += raw_length(p_raw) + raw_length(n_raw);
+        put_free_raw(p_boundary_ptr,
+                     (boundary.length << 2) | (p_raw & RAW_P_ALLOC));
+        untrack_free(alloc, (uint8_t *)n_boundary_ptr);
+        if (alloc->index != NULL) {
+            index_remove(alloc->index,
+                         granule(alloc, (uint8_t *)n_boundary_ptr));
+            index_resize(alloc->index, granule(alloc, p_boundary_ptr),
+                         boundary.length);
+        }
+        free_tree_set(alloc, granule(alloc, p_boundary_ptr), boundary.length);
+        *(boundary_ptr - 1) = 0;
+        *n_boundary_ptr = 0;
+        // Again, do not need to update p_block of next block because it went
+        // from free -> free.
+        alloc->lr_coalesce++;
+    }
+
+    alloc->deallocations++;
+    alloc->available += boundary.length;
+}
+
+// Learn lifetimes per call site of allocate(): each allocation is keyed by its
+// return address, and its lifetime is measured when it is deallocated. Sites
+// whose allocations turn out to be short-lived are then served by bumping a
+// pointer through an arena of arena_length bytes, taken from the top of the
+// heap, which is rewound as soon as everything in it is freed.
+// allocate_hint() and allocate_zeroed() are never served from the arena.
+bool allocator_predict_enable(allocator_t *alloc, uint16_t arena_length) {
+    if (alloc->predict != NULL) {
+        return true;
+    }
+
+    predictor_t *predict = calloc(1, sizeof(predictor_t));
+    if (predict == NULL) {
+        return false;
+    }
+
+    uint8_t *block = allocate_hint(alloc, arena_length, ALLOC_PERMANENT);
+    if (block == NULL) {
+        free(predict);
+        return false;
+    }
+
+    memset(predict->site_of, PREDICT_NO_SITE, sizeof(predict->site_of));
+    predict->arena_block = block;
+    predict->arena = block - sizeof(raw_boundary_t) + HEAP_ALIGN;
+    predict->arena_end = block - sizeof(raw_boundary_t) +
+                         raw_length(*raw_at(block - sizeof(raw_boundary_t)));
+    predict->bump = predict->arena;
+    alloc->predict = predict;
+    return true;
+}
+
+// Turn prediction off again and return the arena to the heap; fails while
+// anything in the arena is still live.
+bool allocator_predict_disable(allocator_t *alloc) {
+    predictor_t *predict = alloc->predict;
+
+    if (predict == NULL) {
+        return true;
+    }
+    if (predict->arena_live != 0) {
+        return false;
+    }
+
+    alloc->predict = NULL;
+    deallocate(alloc, predict->arena_block);
+    free(predict);
+    return true;
+}
+
+// Serve requests of up to RUN_SMALL bytes made through allocate() from a run
+// of whole cache lines owned by the calling thread, so that small objects of
+// different threads never share a line. Threads still need alloc->lock
+// around allocate() and deallocate() if they share the allocator.
+bool allocator_isolate_enable(allocator_t *alloc) {
+    if (alloc->runs != NULL) {
+        return true;
+    }
+
+    alloc->runs = calloc(1, sizeof(runs_t));
+    return alloc->runs != NULL;
+}
+
+// Turn isolation off again and return the runs to the heap; fails while
+// anything in a run is still live.
+bool allocator_isolate_disable(allocator_t *alloc) {
+    runs_t *runs = alloc->runs;
+
+    if (runs == NULL) {
+        return true;
+    }
+    for (int i = 0; i < RUN_MAX; i++) {
+        if (runs->runs[i].live != 0) {
+            return false;
+        }
+    }
+
+    alloc->runs = NULL;
+    for (int i = 0; i < RUN_MAX; i++) {
+        if (runs->runs[i].block != NULL) {
+            deallocate(alloc, runs->runs[i].block);
+        }
+    }
+    free(runs);
+    return true;
+}
+
+// Set aside an emergency block of length bytes at the top of the heap. It is
+// given back once an allocation fails even after the out-of-memory callback,
+// so that the allocation can still be served; call this again to re-arm it.
+bool allocator_reserve(allocator_t *alloc, uint16_t length) {
+    if (alloc->reserve != NULL) {
+        return false;
+    }
+
+    alloc->reserve = allocate_hint(alloc, length, ALLOC_PERMANENT);
+    return alloc->reserve != NULL;
+}
+
+// Keep the free blocks in an address-ordered explicit free list, indexed by a
+// skip list, for alloc->scan = SCAN_ORDERED. When a block is freed next to a
+// free block, or split, it takes the neighbour's place and tower, for the one
+// O(log n) search that removing the neighbour takes anyway; only a block freed
+// between two allocated ones gets a search and a tower of its own.
+bool allocator_index_enable(allocator_t *alloc) {
+    if (alloc->index != NULL) {
+        return true;
+    }
+
+    alloc->index = calloc(1, sizeof(free_index_t));
+    if (alloc->index == NULL) {
+        return false;
+    }
+    heap_ready(alloc);
+
+    alloc->index->seed = 2463534242;
+    index_build(alloc);
+    return true;
+}
+
+void allocator_index_disable(allocator_t *alloc) {
+    free(alloc->index);
+    alloc->index = NULL;
+}
+
+// Bytes usable at ptr, found through the page map rather than by trusting
+// the memory before ptr; 0 for pointers that are in no heap, or that are not
+// an allocated block. The arena's blocks carry no tags, so their size is not
+// known either; nor is anything in a heap not yet formatted.
+size_t allocator_usable_size(void *ptr) {
+    allocator_t *alloc = pagemap_lookup(ptr);
+    uint8_t *block = (uint8_t *)ptr - sizeof(raw_boundary_t);
+
+    if (alloc == NULL || !alloc->formatted) {
+        return 0;
+    }
+    if (!is_block_start(alloc, block)) {
+        return 0;
+    }
+
+    return raw_length(*raw_at(block)) - sizeof(raw_boundary_t);
+}
+
+// Free ptr into whichever heap it came from, under that heap's lock. Pointers
+// that are in no heap (NULL included) are left alone; returns whether ptr was
+// in one.
+bool deallocate_checked(void *ptr) {
+    allocator_t *alloc = pagemap_lookup(ptr);
+
+    if (alloc == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&alloc->lock);
+    deallocate(alloc, ptr);
+    pthread_mutex_unlock(&alloc->lock);
+    return true;
+}
+
+static bool deferred_push(deferred_t *deferred, void *ptr) {
+    size_t pos = atomic_load_explicit(&deferred->tail, memory_order_relaxed);
+
+    for (;;) {
+        struct deferred_slot_t *slot =
+            &deferred->slots[pos % DEFERRED_CAPACITY];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(&deferred->tail, &pos,
+                                                      pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                slot->ptr = ptr;
+                atomic_store_explicit(&slot->seq, pos + 1,
+                                      memory_order_release);
+                return true;
+            }
+        } else if (seq < pos) {
+            return false; // Full.
+        } else {
+            pos = atomic_load_explicit(&deferred->tail, memory_order_relaxed);
+        }
+    }
+}
+
+// Only called with drain_lock held.
+static void *deferred_pop(deferred_t *deferred) {
+    size_t pos = deferred->head;
+    struct deferred_slot_t *slot = &deferred->slots[pos % DEFERRED_CAPACITY];
+
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1) {
+        return NULL;
+    }
+
+    void *ptr = slot->ptr;
+    atomic_store_explicit(&slot->seq, pos + DEFERRED_CAPACITY,
+                          memory_order_release);
+    deferred->head++;
+    return ptr;
+}
+
+static int compare_address(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t) * (void *const *)a;
+    uintptr_t y = (uintptr_t) * (void *const *)b;
+    return (x > y) - (x < y);
+}
+
+// Free up to one batch of queued pointers, in address order and under a
+// single acquisition of the heap lock; returns how many were freed.
+static size_t deferred_drain(allocator_t *alloc) {
+    deferred_t *deferred = alloc->deferred;
+    void *batch[DEFERRED_BATCH];
+    size_t n = 0;
+
+    pthread_mutex_lock(&deferred->drain_lock);
+    while (n < DEFERRED_BATCH && (batch[n] = deferred_pop(deferred)) != NULL) {
+        n++;
+    }
+
+    if (n != 0) {
+        qsort(batch, n, sizeof(void *), compare_address);
+        pthread_mutex_lock(&alloc->lock);
+        for (size_t i = 0; i < n; i++) {
+            deallocate(alloc, batch[i]);
+        }
+        pthread_mutex_unlock(&alloc->lock);
+        deferred->batches++;
+        deferred->frees += n;
+    }
+    pthread_mutex_unlock(&deferred->drain_lock);
+
+    return n;
+}
+
+static void *deferred_main(void *arg) {
+    allocator_t *alloc = arg;
+    const struct timespec idle = {.tv_sec = 0, .tv_nsec = DEFERRED_IDLE_NS};
+
+    while (atomic_load(&alloc->deferred->running)) {
+        if (deferred_drain(alloc) == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+// Start the helper thread behind deallocate_async().
+bool allocator_async_start(allocator_t *alloc) {
+    if (alloc->deferred != NULL) {
+        return true;
+    }
+
+    deferred_t *deferred = calloc(1, sizeof(deferred_t));
+    if (deferred == NULL) {
+        return false;
+    }
+
+    for (size_t i = 0; i < DEFERRED_CAPACITY; i++) {
+        atomic_init(&deferred->slots[i].seq, i);
+    }
+    pthread_mutex_init(&deferred->drain_lock, NULL);
+    atomic_init(&deferred->running, true);
+    alloc->deferred = deferred;
+
+    if (pthread_create(&deferred->thread, NULL, deferred_main, alloc) != 0) {
+        alloc->deferred = NULL;
+        free(deferred);
+        return false;
+    }
+
+    return true;
+}
+
+// Free everything queued so far on the calling thread.
+void deallocate_flush(allocator_t *alloc) {
+    if (alloc->deferred == NULL) {
+        return;
+    }
+
+    while (deferred_drain(alloc) != 0) {
+    }
+}
+
+// Stop the helper thread, after freeing whatever is still queued.
+void allocator_async_stop(allocator_t *alloc) {
+    deferred_t *deferred = alloc->deferred;
+
+    if (deferred == NULL) {
+        return;
+    }
+
+    atomic_store(&deferred->running, false);
+    pthread_join(deferred->thread, NULL);
+    deallocate_flush(alloc);
+    alloc->deferred = NULL;
+    pthread_mutex_destroy(&deferred->drain_lock);
+    free(deferred);
+}
+
+// Queue ptr to be freed by the helper thread, keeping coalescing and the heap
+// lock off the caller's critical path. The helper frees in batches, sorted by
+// address and with the heap lock taken once per batch. If the queue is full
+// (or the helper is not running) ptr is freed right away instead.
+void deallocate_async(allocator_t *alloc, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    if (alloc->deferred != NULL && deferred_push(alloc->deferred, ptr)) {
+        return;
+    }
+
+    if (alloc->deferred != NULL) {
+        atomic_fetch_add(&alloc->deferred->overflows, 1);
+    }
+    pthread_mutex_lock(&alloc->lock);
+    deallocate(alloc, ptr);
+    pthread_mutex_unlock(&alloc->lock);
+}
+
+// Epoch-based reclamation for lock-free structures built on the heap: a block
+// that readers may still be dereferencing is handed to retire() instead of
+// deallocate(), and only freed once every registered thread has passed a
+// quiescent point (epoch_quiescent()) since. A block retired in epoch e is
+// freed once the global epoch reaches e + 2, and the global epoch only moves
+// on once every registered thread has seen the current one.
+bool allocator_epoch_enable(allocator_t *alloc) {
+    if (alloc->epoch != NULL) {
+        return true;
+    }
+
+    epoch_t *epoch = calloc(1, sizeof(epoch_t));
+    if (epoch == NULL) {
+        return false;
+    }
+
+    for (int i = 0; i < EPOCH_THREADS; i++) {
+        epoch->threads[i].alloc = alloc;
+    }
+    alloc->epoch = epoch;
+    return true;
+}
+
+// Free the blocks of limbo, in address order; only called with the heap lock
+// held.
+static void limbo_free(allocator_t *alloc, struct limbo_t *limbo) {
+    if (limbo->count == 0) {
+        return;
+    }
+
+    qsort(limbo->ptrs, limbo->count, sizeof(void *), compare_address);
+    for (size_t i = 0; i < limbo->count; i++) {
+        deallocate(alloc, limbo->ptrs[i]);
+    }
+    atomic_fetch_add(&alloc->epoch->reclaimed, limbo->count);
+    limbo->count = 0;
+}
+
+// Free everything still retired and turn reclamation off again. Only called
+// once no thread is registered any more.
+void allocator_epoch_disable(allocator_t *alloc) {
+    epoch_t *epoch = alloc->epoch;
+
+    if (epoch == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&alloc->lock);
+    for (int i = 0; i < EPOCH_THREADS; i++) {
+        assert(!atomic_load(&epoch->threads[i].used));
+        for (int j = 0; j < 3; j++) {
+            limbo_free(alloc, &epoch->threads[i].limbo[j]);
+            free(epoch->threads[i].limbo[j].ptrs);
+        }
+    }
+    pthread_mutex_unlock(&alloc->lock);
+    alloc->epoch = NULL;
+    free(epoch);
+}
+
+// Register the calling thread with the epochs of alloc, or NULL if all slots
+// are taken. The thread then has to call epoch_quiescent() regularly.
+epoch_thread_t *epoch_register(allocator_t *alloc) {
+    epoch_t *epoch = alloc->epoch;
+
+    for (int i = 0; i < EPOCH_THREADS; i++) {
+        epoch_thread_t *self = &epoch->threads[i];
+        bool used = false;
+        if (atomic_compare_exchange_strong(&self->used, &used, true)) {
+            atomic_store(&self->local, atomic_load(&epoch->global));
+            self->until_collect = EPOCH_BATCH;
+            return self;
+        }
+    }
+
+    return NULL;
+}
+
+// Declare that the calling thread holds no references to retired blocks.
+void epoch_quiescent(epoch_thread_t *self) {
+    atomic_store(&self->local, atomic_load(&self->alloc->epoch->global));
+}
+
+// Move the global epoch on if every registered thread has seen it.
+static void epoch_try_advance(epoch_t *epoch) {
+    unsigned long global = atomic_load(&epoch->global);
+
+    for (int i = 0; i < EPOCH_THREADS; i++) {
+        if (atomic_load(&epoch->threads[i].used) &&
+            atomic_load(&epoch->threads[i].local) != global) {
+            return;
+        }
+    }
+
+    if (atomic_compare_exchange_strong(&epoch->global, &global, global + 1)) {
+        atomic_fetch_add(&epoch->advances, 1);
+    }
+}
+
+// Free the calling thread's retired blocks that no reader can reach any more,
+// taking the heap lock once; returns how many were freed.
+size_t epoch_collect(epoch_thread_t *self) {
+    allocator_t *alloc = self->alloc;
+    bool locked = false;
+    size_t n = 0;
+
+    epoch_try_advance(alloc->epoch);
+    unsigned long global = atomic_load(&alloc->epoch->global);
+    self->until_collect = EPOCH_BATCH;
+
+    for (int i = 0; i < 3; i++) {
+        struct limbo_t *limbo = &self->limbo[i];
+        if (limbo->count == 0 || global < limbo->epoch + 2) {
+            continue;
+        }
+        if (!locked) {
+            pthread_mutex_lock(&alloc->lock);
+            locked = true;
+        }
+        n += limbo->count;
+        limbo_free(alloc, limbo);
+    }
+    if (locked) {
+        pthread_mutex_unlock(&alloc->lock);
+    }
+
+    return n;
+}
+
+// Give up the calling thread's slot. Blocks that cannot be freed yet stay with
+// the slot until the next thread to take it collects them, or until
+// allocator_epoch_disable().
+void epoch_unregister(epoch_thread_t *self) {
+    epoch_collect(self);
+    atomic_store(&self->used, false);
+}
+
+// Queue ptr to be freed once no reader can reach it any more. Every
+// EPOCH_BATCH retirements the thread tries to reclaim what it has queued.
+// Returns false, leaving ptr alone, if there is no memory to queue it.
+bool retire(epoch_thread_t *self, void *ptr) {
+    allocator_t *alloc = self->alloc;
+
+    if (ptr == NULL) {
+        return true;
+    }
+
+    unsigned long global = atomic_load(&alloc->epoch->global);
+    struct limbo_t *limbo = &self->limbo[global % 3];
+
+    // Left over from three or more epochs ago, so no longer reachable.
+    if (limbo->count != 0 && limbo->epoch != global) {
+        pthread_mutex_lock(&alloc->lock);
+        limbo_free(alloc, limbo);
+        pthread_mutex_unlock(&alloc->lock);
+    }
+    limbo->epoch = global;
+
+    if (limbo->count == limbo->capacity) {
+        size_t capacity = limbo->capacity == 0 ? EPOCH_BATCH
+                                               : limbo->capacity * 2;
+        void **ptrs = realloc(limbo->ptrs, capacity * sizeof(void *));
+        if (ptrs == NULL) {
+            return false;
+        }
+        limbo->ptrs = ptrs;
+        limbo->capacity = capacity;
+    }
+    limbo->ptrs[limbo->count++] = ptr;
+    atomic_fetch_add(&alloc->epoch->retired, 1);
+
+    if (--self->until_collect == 0) {
+        epoch_collect(self);
+    }
+
+    return true;
+}
+
+// NUMA-aware arenas: one heap per node, bound to that node's memory, with each
+// thread allocating from the heap of the node it runs on.
+#define NUMA_MAX_NODES 8
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+struct numa_arenas_t {
+    int nodes;
+    bool fake; // Topology made up: threads are dealt out to nodes in turn.
+    atomic_int next_node; // For the fake topology.
+    pthread_key_t key;    // Node of the calling thread plus one, once known.
+    size_t bind_failures;
+    allocator_t arenas[NUMA_MAX_NODES];
+};
+
+typedef struct numa_arenas_t numa_arenas_t;
+
+// Number of nodes in /sys/devices/system/node/online ("0", "0-1", "0,2-3"...),
+// or 1 if it cannot be read.
+static int numa_online_nodes(void) {
+    FILE *in = fopen("/sys/devices/system/node/online", "r");
+    int highest = 0, node;
+
+    if (in == NULL) {
+        return 1;
+    }
+    while (fscanf(in, "%d", &node) == 1) {
+        highest = node > highest ? node : highest;
+        if (fgetc(in) == EOF) {
+            break;
+        }
+    }
+    fclose(in);
+
+    return highest + 1 < NUMA_MAX_NODES ? highest + 1 : NUMA_MAX_NODES;
+}
+
+// Bind the heap to node with the raw mbind syscall, so that no libnuma is
+// needed; MPOL_MF_MOVE migrates the page already touched by allocator_init().
+static bool numa_bind(allocator_t *alloc, int node) {
+    unsigned long nodemask = 1UL << node;
+
+    return syscall(SYS_mbind, alloc->heap, HEAP_SIZE, MPOL_BIND, &nodemask,
+                   sizeof(nodemask) * 8, MPOL_MF_MOVE) == 0;
+}
+
+// Set up one arena per NUMA node. With fake_nodes != 0 the host's topology is
+// ignored and fake_nodes nodes are made up instead (without binding), so the
+// routing can be exercised on single-node machines.
+bool numa_arenas_init(numa_arenas_t *numa, int fake_nodes) {
+    numa->fake = fake_nodes != 0;
+    numa->nodes = numa->fake ? fake_nodes : numa_online_nodes();
+    if (NUMA_MAX_NODES < numa->nodes) {
+        numa->nodes = NUMA_MAX_NODES;
+    }
+    atomic_init(&numa->next_node, 0);
+    numa->bind_failures = 0;
+    if (pthread_key_create(&numa->key, NULL) != 0) {
+        return false;
+    }
+
+    for (int node = 0; node < numa->nodes; node++) {
+        if (!allocator_init(&numa->arenas[node])) {
+            while (0 < node--) {
+                allocator_deinit(&numa->arenas[node]);
+            }
+            pthread_key_delete(numa->key);
+            return false;
+        }
+        if (!numa->fake && 1 < numa->nodes &&
+            !numa_bind(&numa->arenas[node], node)) {
+            numa->bind_failures++;
+        }
+    }
+
+    return true;
+}
+
+void numa_arenas_deinit(numa_arenas_t *numa) {
+    pthread_key_delete(numa->key);
+    for (int node = 0; node < numa->nodes; node++) {
+        allocator_deinit(&numa->arenas[node]);
+    }
+}
+
+// Node of the calling thread, looked up once per thread and set of arenas.
+static int numa_thread_node(numa_arenas_t *numa) {
+    intptr_t known = (intptr_t)pthread_getspecific(numa->key);
+    if (known != 0) {
+        return known - 1;
+    }
+
+    unsigned cpu, node = 0;
+    if (numa->fake) {
+        node = atomic_fetch_add(&numa->next_node, 1);
+    } else if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0) {
+        node = 0;
+    }
+    node %= numa->nodes;
+    pthread_setspecific(numa->key, (void *)(intptr_t)(node + 1));
+    return node;
+}
+
+// The arena whose heap contains ptr, or -1.
+static int numa_owner(numa_arenas_t *numa, void *ptr) {
+    allocator_t *alloc = pagemap_lookup(ptr);
+
+    if (alloc == NULL || alloc < numa->arenas ||
+        numa->arenas + numa->nodes <= alloc) {
+        return -1;
+    }
+
+    return alloc - numa->arenas;
+}
+
+// Allocate from the calling thread's node, falling back to the other nodes
+// when its arena is full.
+void *numa_allocate(numa_arenas_t *numa, uint16_t length) {
+    int local = numa_thread_node(numa);
+
+    for (int i = 0; i < numa->nodes; i++) {
+        allocator_t *arena = &numa->arenas[(local + i) % numa->nodes];
+        pthread_mutex_lock(&arena->lock);
+        void *ptr = allocate_hint(arena, length, 0);
+        pthread_mutex_unlock(&arena->lock);
+        if (ptr != NULL) {
+            return ptr;
+        }
+    }
+
+    return NULL;
+}
+
+// Return ptr to the arena it came from, counting it as remote if that arena
+// belongs to another node than the calling thread's.
+void numa_deallocate(numa_arenas_t *numa, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    int owner = numa_owner(numa, ptr);
+    if (owner < 0) {
+        DBG("Tried to free %p, which is in none of the arenas", ptr);
+        return;
+    }
+
+    allocator_t *arena = &numa->arenas[owner];
+    pthread_mutex_lock(&arena->lock);
+    if (owner != numa_thread_node(numa)) {
+        arena->remote_frees++;
+    }
+    deallocate(arena, ptr);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+// Per-thread heaps: every thread allocates from a heap of its own, and the
+// heaps it still has blocks in when it exits are left for other threads to
+// adopt.
+#define THREAD_HEAPS_MAX 16
+
+enum heap_state_t {
+    HEAP_FREE,      // Nobody's; nothing allocated in it.
+    HEAP_OWNED,     // A live thread allocates from it.
+    HEAP_ABANDONED, // Its thread exited with blocks still allocated.
+};
+
+struct thread_heap_t {
+    allocator_t alloc;
+    atomic_int state;
+    unsigned long owner; // thread_id of the owning thread.
+    struct thread_heaps_t *registry;
+};
+
+typedef struct thread_heap_t thread_heap_t;
+
+struct thread_heaps_t {
+    pthread_key_t key; // A thread's current heap; handles its exit.
+    thread_heap_t heaps[THREAD_HEAPS_MAX];
+    atomic_size_t abandons;
+    atomic_size_t adoptions;
+};
+
+typedef struct thread_heaps_t thread_heaps_t;
+
+static atomic_ulong next_thread_id = 1;
+static _Thread_local unsigned long thread_id;
+
+static unsigned long current_thread_id(void) {
+    if (thread_id == 0) {
+        thread_id = atomic_fetch_add(&next_thread_id, 1);
+    }
+    return thread_id;
+}
+
+// A heap not yet formatted is empty, and is left so.
+static bool heap_is_empty(allocator_t *alloc) {
+    if (!alloc->formatted) {
+        return true;
+    }
+    raw_boundary_t raw = *raw_at(alloc->heap);
+    return !(raw & RAW_ALLOC) && raw_length(raw) == HEAP_SIZE - HEAP_ALIGN;
+}
+
+// Thread exit: give up every heap the thread owns, abandoning the ones it still
+// has blocks in.
+static void thread_heap_exit(void *value) {
+    thread_heap_t *current = value;
+    thread_heaps_t *registry = current->registry;
+
+    for (int i = 0; i < THREAD_HEAPS_MAX; i++) {
+        thread_heap_t *heap = &registry->heaps[i];
+        if (atomic_load(&heap->state) != HEAP_OWNED ||
+            heap->owner != current->owner) {
+            continue;
+        }
+
+        // The state changes under the lock, like in thread_heap_deallocate(),
+        // so that a remote free of the last block cannot slip in between.
+        pthread_mutex_lock(&heap->alloc.lock);
+        bool empty = heap_is_empty(&heap->alloc);
+        atomic_store(&heap->state, empty ? HEAP_FREE : HEAP_ABANDONED);
+        if (!empty) {
+            atomic_fetch_add(&registry->abandons, 1);
+        }
+        pthread_mutex_unlock(&heap->alloc.lock);
+    }
+}
+
+bool thread_heaps_init(thread_heaps_t *registry) {
+    if (pthread_key_create(&registry->key, thread_heap_exit) != 0) {
+        return false;
+    }
+
+    for (int i = 0; i < THREAD_HEAPS_MAX; i++) {
+        if (!allocator_init(&registry->heaps[i].alloc)) {
+            while (0 < i--) {
+                allocator_deinit(&registry->heaps[i].alloc);
+            }
+            pthread_key_delete(registry->key);
+            return false;
+        }
+        atomic_init(&registry->heaps[i].state, HEAP_FREE);
+        registry->heaps[i].owner = 0;
+        registry->heaps[i].registry = registry;
+    }
+    atomic_init(&registry->abandons, 0);
+    atomic_init(&registry->adoptions, 0);
+    return true;
+}
+
+void thread_heaps_deinit(thread_heaps_t *registry) {
+    pthread_key_delete(registry->key);
+    for (int i = 0; i < THREAD_HEAPS_MAX; i++) {
+        allocator_deinit(&registry->heaps[i].alloc);
+    }
+}
+
+// Take over a heap for the calling thread: an abandoned one if there is any,
+// so that its free blocks get reused, and a free one otherwise.
+static thread_heap_t *thread_heap_claim(thread_heaps_t *registry) {
+    const int wanted[] = {HEAP_ABANDONED, HEAP_FREE};
+
+    for (int w = 0; w < 2; w++) {
+        for (int i = 0; i < THREAD_HEAPS_MAX; i++) {
+            thread_heap_t *heap = &registry->heaps[i];
+            int state = wanted[w];
+            if (atomic_compare_exchange_strong(&heap->state, &state,
+                                               HEAP_OWNED)) {
+                heap->owner = current_thread_id();
+                if (wanted[w] == HEAP_ABANDONED) {
+                    atomic_fetch_add(&registry->adoptions, 1);
+                }
+                pthread_setspecific(registry->key, heap);
+                return heap;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Allocate from the calling thread's heap, claiming another one when it has
+// none yet or its current one is full.
+void *thread_heap_allocate(thread_heaps_t *registry, uint16_t length) {
+    thread_heap_t *heap = pthread_getspecific(registry->key);
+
+    if (heap == NULL) {
+        heap = thread_heap_claim(registry);
+    }
+
+    while (heap != NULL) {
+        // Other threads may be freeing into it.
+        pthread_mutex_lock(&heap->alloc.lock);
+        void *ptr = allocate_hint(&heap->alloc, length, 0);
+        pthread_mutex_unlock(&heap->alloc.lock);
+        if (ptr != NULL) {
+            return ptr;
+        }
+        heap = thread_heap_claim(registry);
+    }
+
+    return NULL;
+}
+
+// Free ptr into whichever heap it came from, owned, abandoned or not. An
+// abandoned heap that is emptied this way becomes free again.
+void thread_heap_deallocate(thread_heaps_t *registry, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    // alloc is the first member of thread_heap_t.
+    thread_heap_t *heap = (thread_heap_t *)pagemap_lookup(ptr);
+    if (heap == NULL || heap < registry->heaps ||
+        registry->heaps + THREAD_HEAPS_MAX <= heap) {
+        DBG("Tried to free %p, which is in none of the thread heaps", ptr);
+        return;
+    }
+
+    allocator_t *alloc = &heap->alloc;
+    pthread_mutex_lock(&alloc->lock);
+    deallocate(alloc, ptr);
+    int state = HEAP_ABANDONED;
+    if (heap_is_empty(alloc)) {
+        atomic_compare_exchange_strong(&heap->state, &state, HEAP_FREE);
+    }
+    pthread_mutex_unlock(&alloc->lock);
+}
+
+// Thread caches: per-thread stacks of free blocks by size class in front of a
+// shared, locked heap. A cache that runs dry steals from the fullest peer.
+#define TCACHE_MAX 16
+#define TCACHE_CAPACITY 64 // Blocks per class and cache.
+#define TCACHE_STEAL_BATCH 8
+
+// Chase-Lev work-stealing deque with a fixed capacity: the owner pushes and
+// pops at the bottom, thieves steal from the top.
+struct deque_t {
+    atomic_long top;
+    atomic_long bottom;
+    _Atomic(void *) slots[TCACHE_CAPACITY];
+};
+
+typedef struct deque_t deque_t;
+
+struct tcache_t {
+    struct tcaches_t *shared;
+    atomic_bool used;
+    deque_t bins[SIZE_CLASS_COUNT];
+};
+
+typedef struct tcache_t tcache_t;
+
+struct tcaches_t {
+    allocator_t *alloc; // Shared heap, used under alloc->lock.
+    tcache_t caches[TCACHE_MAX];
+};
+
+typedef struct tcaches_t tcaches_t;
+
+static bool deque_push(deque_t *deque, void *ptr) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+    if (TCACHE_CAPACITY <= bottom - top) {
+        return false;
+    }
+
+    atomic_store_explicit(&deque->slots[bottom % TCACHE_CAPACITY], ptr,
+                          memory_order_relaxed);
+    // Publishes the slot, and everything the owner did with the block before
+    // (a thief may hand it straight back to the heap).
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+    return true;
+}
+
+static void *deque_pop(deque_t *deque) {
+    long bottom =
+        atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    void *ptr = NULL;
+
+    if (top <= bottom) {
+        ptr = atomic_load_explicit(&deque->slots[bottom % TCACHE_CAPACITY],
+                                   memory_order_relaxed);
+        if (top == bottom) {
+            // Last one; race the thieves for it.
+            if (!atomic_compare_exchange_strong_explicit(
+                    &deque->top, &top, top + 1, memory_order_seq_cst,
+                    memory_order_relaxed)) {
+                ptr = NULL;
+            }
+            atomic_store_explicit(&deque->bottom, bottom + 1,
+                                  memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&deque->bottom, bottom + 1,
+                              memory_order_relaxed);
+    }
+
+    return ptr;
+}
+
+// Returns NULL if the deque is empty or another thief won.
+static void *deque_steal(deque_t *deque) {
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (bottom <= top) {
+        return NULL;
+    }
+
+    void *ptr = atomic_load_explicit(&deque->slots[top % TCACHE_CAPACITY],
+                                     memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return NULL;
+    }
+    return ptr;
+}
+
+static long deque_size(deque_t *deque) {
+    long size = atomic_load_explicit(&deque->bottom, memory_order_relaxed) -
+                atomic_load_explicit(&deque->top, memory_order_relaxed);
+    return size < 0 ? 0 : size;
+}
+
+void tcaches_init(tcaches_t *shared, allocator_t *alloc) {
+    memset(shared, 0, sizeof(tcaches_t));
+    shared->alloc = alloc;
+    for (int i = 0; i < TCACHE_MAX; i++) {
+        shared->caches[i].shared = shared;
+    }
+}
+
+// Claim a cache for the calling thread, or NULL if all are taken.
+tcache_t *tcache_register(tcaches_t *shared) {
+    for (int i = 0; i < TCACHE_MAX; i++) {
+        bool used = false;
+        if (atomic_compare_exchange_strong(&shared->caches[i].used, &used,
+                                           true)) {
+            return &shared->caches[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Return every cached block to the heap and give the cache up.
+void tcache_unregister(tcache_t *cache) {
+    allocator_t *alloc = cache->shared->alloc;
+
+    pthread_mutex_lock(&alloc->lock);
+    for (int class = 0; class < SIZE_CLASS_COUNT; class++) {
+        void *ptr;
+        while ((ptr = deque_pop(&cache->bins[class])) != NULL) {
+            deallocate(alloc, ptr);
+        }
+    }
+    pthread_mutex_unlock(&alloc->lock);
+    atomic_store(&cache->used, false);
+}
+
+// Refill the (empty) bin of class from the peer cache holding the most blocks
+// of it, taking up to TCACHE_STEAL_BATCH of them.
+static bool tcache_steal(tcache_t *cache, uint8_t class) {
+    tcaches_t *shared = cache->shared;
+    deque_t *victim = NULL;
+    long most = 0;
+
+    for (int i = 0; i < TCACHE_MAX; i++) {
+        tcache_t *peer = &shared->caches[i];
+        if (peer == cache || !atomic_load(&peer->used)) {
+            continue;
+        }
+        long size = deque_size(&peer->bins[class]);
+        if (most < size) {
+            most = size;
+            victim = &peer->bins[class];
+        }
+    }
+
+    int stolen = 0;
+    while (victim != NULL && stolen < TCACHE_STEAL_BATCH) {
+        void *ptr = deque_steal(victim);
+        if (ptr == NULL) {
+            break;
+        }
+        if (!deque_push(&cache->bins[class], ptr)) {
+            // No room after all; the block goes back to the heap.
+            pthread_mutex_lock(&shared->alloc->lock);
+            deallocate(shared->alloc, ptr);
+            pthread_mutex_unlock(&shared->alloc->lock);
+            break;
+        }
+        stolen++;
+    }
+
+    atomic_fetch_add(stolen ? &shared->alloc->steals
+                            : &shared->alloc->steal_failures,
+                     1);
+    return stolen != 0;
+}
+
+// Record the class of the block at block, length bytes long, if it is exactly
+// as long as one; only called with the heap lock held.
+static void tcache_mark(allocator_t *alloc, uint8_t *block, uint16_t length) {
+    uint8_t class = SIZE_CLASS_INDEX[length / HEAP_ALIGN];
+
+    if (class != SIZE_CLASS_NONE && SIZE_CLASS_LENGTH[class] == length) {
+        alloc->block_class[granule(alloc, block)] = class;
+    }
+}
+
+void *tcache_allocate(tcache_t *cache, uint16_t length) {
+    allocator_t *alloc = cache->shared->alloc;
+
+    if (length != 0 &&
+        length <= HEAP_SIZE - HEAP_ALIGN - sizeof(raw_boundary_t)) {
+        uint8_t class =
+            SIZE_CLASS_INDEX[pad_length(length + sizeof(raw_boundary_t)) /
+                             HEAP_ALIGN];
+
+        if (class != SIZE_CLASS_NONE) {
+            void *ptr = deque_pop(&cache->bins[class]);
+            if (ptr == NULL && tcache_steal(cache, class)) {
+                ptr = deque_pop(&cache->bins[class]);
+            }
+            if (ptr != NULL) {
+                return ptr;
+            }
+            // Carve it with its class length, so that it can be cached later.
+            length = size_class_round(length);
+        }
+    }
+
+    pthread_mutex_lock(&alloc->lock);
+    uint8_t *ptr = allocate_hint(alloc, length, 0);
+    if (ptr != NULL) {
+        uint8_t *block = ptr - sizeof(raw_boundary_t);
+        tcache_mark(alloc, block, raw_length(*raw_at(block)));
+    }
+    pthread_mutex_unlock(&alloc->lock);
+    return ptr;
+}
+
+// Keep ptr in the cache if its block was carved with the length of a size
+// class and the bin has room; hand it back to the heap otherwise. The class
+// comes from alloc->block_class rather than the tags, which a deallocate() of
+// the block before it may be rewriting, so only the fallback takes the lock.
+void tcache_deallocate(tcache_t *cache, void *ptr) {
+    allocator_t *alloc = cache->shared->alloc;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    uintptr_t offset = (uintptr_t)ptr - sizeof(raw_boundary_t) -
+                       (uintptr_t)alloc->heap;
+    if (alloc->formatted && offset < HEAP_SIZE && offset % HEAP_ALIGN == 0) {
+        uint8_t class = alloc->block_class[offset / HEAP_ALIGN];
+        if (class != SIZE_CLASS_NONE &&
+            deque_push(&cache->bins[class], ptr)) {
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&alloc->lock);
+    deallocate(alloc, ptr);
+    pthread_mutex_unlock(&alloc->lock);
+}
+
+// Read a request histogram from the "h <block length> <count>" lines of
+// allocator_stats_dump() into hist (by block length / HEAP_ALIGN), skipping
+// every other line; returns the requests read.
+size_t histogram_read(FILE *in, uint32_t hist[HEAP_GRANULES]) {
+    char line[256];
+    size_t requests = 0;
+
+    memset(hist, 0, HEAP_GRANULES * sizeof(uint32_t));
+    while (fgets(line, sizeof(line), in) != NULL) {
+        unsigned long length, count;
+        if (sscanf(line, "h %lu %lu", &length, &count) != 2 ||
+            length % HEAP_ALIGN != 0 || HEAP_GRANULES <= length / HEAP_ALIGN) {
+            continue;
+        }
+        hist[length / HEAP_ALIGN] += count;
+        requests += count;
+    }
+
+    return requests;
+}
+
+// Fill the cache ahead of the first requests with blocks in proportion to
+// hist (as read by histogram_read()), taking up to budget bytes of the heap.
+// The blocks are carved one after the other from the free blocks in address
+// order, in a single pass over the heap. Returns the blocks cached.
+size_t tcache_warm(tcache_t *cache, const uint32_t hist[HEAP_GRANULES],
+                   uint16_t budget) {
+    allocator_t *alloc = cache->shared->alloc;
+    uint64_t requests[SIZE_CLASS_COUNT] = {0};
+    uint64_t bytes = 0;
+
+    for (int g = 1; g < HEAP_GRANULES; g++) {
+        uint8_t class = SIZE_CLASS_INDEX[g];
+        if (class != SIZE_CLASS_NONE) {
+            requests[class] += hist[g];
+            bytes += (uint64_t)hist[g] * SIZE_CLASS_LENGTH[class];
+        }
+    }
+    if (bytes == 0) {
+        return 0;
+    }
+
+    // Blocks wanted per class, scaled down to the budget (rounded to nearest)
+    // and to the room left in the bin.
+    long wanted[SIZE_CLASS_COUNT];
+    for (int class = 0; class < SIZE_CLASS_COUNT; class++) {
+        uint64_t share = (requests[class] * budget + bytes / 2) / bytes;
+        long room = TCACHE_CAPACITY - deque_size(&cache->bins[class]);
+        wanted[class] = (long)share < room ? (long)share : room;
+    }
+
+    size_t cached = 0;
+    int class = 0;
+    pthread_mutex_lock(&alloc->lock);
+    heap_ready(alloc);
+    map_iter_t cursor = {.word = 0, .bits = alloc->free_map[0]};
+    int g = map_next(alloc->free_map, &cursor);
+    while (g >= 0) {
+        while (class < SIZE_CLASS_COUNT && wanted[class] == 0) {
+            class++;
+        }
+        if (class == SIZE_CLASS_COUNT) {
+            break;
+        }
+
+        // Carve from the front of this free block while the next block fits
+        // with nothing, or a whole free block, left over.
+        uint8_t *current = alloc->heap + g * HEAP_ALIGN;
+        uint16_t length = SIZE_CLASS_LENGTH[class];
+        uint16_t block_length = raw_length(*raw_at(current));
+        if (length != block_length &&
+            (block_length < length ||
+             block_length - length < split_minimum(alloc))) {
+            g = map_next(alloc->free_map, &cursor);
+            continue;
+        }
+        void *ptr = place(alloc, current, length);
+        alloc->block_class[g] = class;
+        deque_push(&cache->bins[class], ptr);
+        wanted[class]--;
+        cached++;
+        if (length == block_length) {
+            g = map_next(alloc->free_map, &cursor);
+        } else {
+            g += length / HEAP_ALIGN;
+        }
+    }
+    pthread_mutex_unlock(&alloc->lock);
+
+    return cached;
+}
+
+// Zero length bytes at ptr, with non-temporal stores if it is long.
+static void clear(uint8_t *ptr, size_t length) {
+#ifdef __SSE2__
+    if (ZERO_NT_THRESHOLD <= length) {
+        uint8_t *start = (uint8_t *)(((uintptr_t)ptr + 15) & ~(uintptr_t)15);
+        uint8_t *end = (uint8_t *)(((uintptr_t)ptr + length) & ~(uintptr_t)15);
+        __m128i zero = _mm_setzero_si128();
+
+        memset(ptr, 0, start - ptr);
+        for (uint8_t *p = start; p < end; p += 16) {
+            _mm_stream_si128((__m128i *)p, zero);
+        }
+        memset(end, 0, ptr + length - end);
+        _mm_sfence();
+        return;
+    }
+#endif
+    memset(ptr, 0, length);
+}
+
+// Like allocate(), but the returned memory is zeroed. The memset is skipped if
+// the whole block is known to be zero, as after allocator_init() or
+// allocator_purge().
+void *allocate_zeroed(allocator_t *alloc, uint16_t length) {
+    uint8_t *ptr = allocate_hint(alloc, length, 0);
+
+    if (ptr == NULL) {
+        return NULL;
+    }
+
+    uint8_t *block = ptr - sizeof(raw_boundary_t);
+    uint16_t block_length = raw_length(*raw_at(block));
+
+    if (is_clean(alloc, block, block_length)) {
+        // Only the footer of the free block may be left, when it was not split
+        // (or the block was taken from its end).
+        *raw_at(block + block_length - sizeof(raw_boundary_t)) = 0;
+        alloc->zeroed_fast++;
+    } else {
+        clear(ptr, block_length - sizeof(raw_boundary_t));
+        alloc->zeroed_slow++;
+    }
+
+    return ptr;
+}
+
+// Give the heap's memory back to the kernel with MADV_DONTNEED, after which it
+// is known to be zero. That only holds for private anonymous memory, so a
+// caller's buffer is never purged; nor is a heap not yet formatted, which has
+// nothing to give back. The heap is a single page, so this only happens if
+// nothing is allocated; returns whether it did.
+bool allocator_purge(allocator_t *alloc) {
+    if ((!alloc->mapped && alloc->region == NULL) || !alloc->formatted ||
+        !heap_is_empty(alloc)) {
+        return false;
+    }
+
+    if (madvise(alloc->heap, HEAP_SIZE, MADV_DONTNEED) < 0) {
+        return false;
+    }
+
+    // The boundaries are gone with the rest of the page.
+    put_free_raw(alloc->heap, ((HEAP_SIZE - HEAP_ALIGN) << 2) | RAW_P_ALLOC);
+    *raw_at(alloc->heap + (HEAP_SIZE - HEAP_ALIGN)) = (HEAP_ALIGN << 2) |
+                                                      RAW_ALLOC;
+    memset(alloc->zero_map, 0xff, sizeof(alloc->zero_map));
+    alloc->purges++;
+    return true;
+}
+
+// Outcome of replaying a trace.
+struct replay_t {
+    size_t requests;
+    size_t failures;    // Requests that did not fit in the replay.
+    size_t free_blocks; // Sum over the requests of the free blocks then.
+};
+
+typedef struct replay_t replay_t;
+
+// Replay a trace recorded through alloc->trace (from any allocator with the
+// same heap size) on alloc, as configured by the caller. Blocks are matched
+// up by the offsets they had when recorded; requests that failed back then
+// are retried and, if they fit now, freed again at once.
+replay_t replay_trace(allocator_t *alloc, FILE *in) {
+    replay_t result = {0, 0, 0};
+    void *live[HEAP_GRANULES] = {0};
+    char line[64];
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        unsigned length;
+        long offset;
+
+        if (sscanf(line, "a %u %ld", &length, &offset) == 2) {
+            for (int w = 0; w < FREE_MAP_WORDS; w++) {
+                result.free_blocks += __builtin_popcountll(alloc->free_map[w]);
+            }
+            result.requests++;
+            void *ptr = allocate(alloc, length);
+            if (ptr == NULL) {
+                result.failures++;
+            } else if (offset < 0 || HEAP_SIZE <= offset) {
+                deallocate(alloc, ptr);
+            } else {
+                live[offset / HEAP_ALIGN] = ptr;
+            }
+        } else if (sscanf(line, "d %ld", &offset) == 1 && 0 <= offset &&
+                   offset < HEAP_SIZE) {
+            deallocate(alloc, live[offset / HEAP_ALIGN]);
+            live[offset / HEAP_ALIGN] = NULL;
+        }
+    }
+
+    return result;
+}
+
+// Object pools: objects of one type that stay constructed while they are not
+// in use, so that pool_get() skips the constructor whenever the pool has one
+// to hand out. Like the allocator itself, a pool is not thread-safe.
+#define POOL_CAPACITY 64 // Idle objects kept constructed.
+
+struct pool_t {
+    allocator_t *alloc;
+    uint16_t obj_size;
+    void (*ctor)(void *obj);
+    void (*dtor)(void *obj);
+    void *idle[POOL_CAPACITY];
+    int count;
+
+    size_t hits;   // pool_get() served by an idle object.
+    size_t misses; // pool_get() that had to allocate and construct.
+};
+
+typedef struct pool_t pool_t;
+
+// Create a pool of obj_size-byte objects; ctor and dtor may be NULL. Objects
+// are payloads like any other, so they are only 2-byte aligned: a type with
+// wider fields must be read and written with memcpy().
+pool_t *pool_create(allocator_t *alloc, uint16_t obj_size,
+                    void (*ctor)(void *obj), void (*dtor)(void *obj)) {
+    pool_t *pool = calloc(1, sizeof(pool_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->alloc = alloc;
+    pool->obj_size = obj_size;
+    pool->ctor = ctor;
+    pool->dtor = dtor;
+    return pool;
+}
+
+// A constructed object, or NULL if the heap is full.
+void *pool_get(pool_t *pool) {
+    if (pool->count != 0) {
+        pool->hits++;
+        return pool->idle[--pool->count];
+    }
+
+    void *obj = allocate(pool->alloc, pool->obj_size);
+    if (obj == NULL) {
+        return NULL;
+    }
+    if (pool->ctor != NULL) {
+        pool->ctor(obj);
+    }
+    pool->misses++;
+    return obj;
+}
+
+static void pool_release(pool_t *pool, void *obj) {
+    if (pool->dtor != NULL) {
+        pool->dtor(obj);
+    }
+    deallocate(pool->alloc, obj);
+}
+
+// Give obj back to the pool, which keeps it constructed if it has room. The
+// object has to be in its constructed state again.
+void pool_put(pool_t *pool, void *obj) {
+    if (obj == NULL) {
+        return;
+    }
+
+    if (pool->count < POOL_CAPACITY) {
+        pool->idle[pool->count++] = obj;
+    } else {
+        pool_release(pool, obj);
+    }
+}
+
+// Destroy idle objects until at most keep are left, returning their memory to
+// the heap; returns how many were destroyed.
+int pool_shrink(pool_t *pool, int keep) {
+    int n = 0;
+
+    while (keep < pool->count) {
+        pool_release(pool, pool->idle[--pool->count]);
+        n++;
+    }
+
+    return n;
+}
+
+// Destroy the idle objects and the pool; objects still out are left alone.
+void pool_destroy(pool_t *pool) {
+    pool_shrink(pool, 0);
+    free(pool);
+}
+
+// Per-tenant accounting: every block allocated with tenant_allocate() is
+// charged to a tenant, and credited back when it is deallocated. A tenant
+// over its hard limit gets no more memory, and one over its soft limit makes
+// the allocator trim itself first. Usage is counted per CPU and only folded
+// into a shared total every TENANT_BATCH bytes.
+bool allocator_tenants_enable(allocator_t *alloc) {
+    if (alloc->tenants != NULL) {
+        return true;
+    }
+
+    // The per-CPU slots are each on a cache line of their own, which calloc()
+    // does not promise.
+    alloc->tenants = aligned_alloc(_Alignof(tenants_t), sizeof(tenants_t));
+    if (alloc->tenants == NULL) {
+        return false;
+    }
+
+    memset(alloc->tenants, 0, sizeof(tenants_t));
+    memset(alloc->tenants->owner, TENANT_NONE, sizeof(alloc->tenants->owner));
+    return true;
+}
+
+// Set the limits of tenant in bytes, 0 meaning none; fails if tenants are not
+// enabled or tenant is not below TENANT_MAX.
+bool tenant_set_limits(allocator_t *alloc, uint8_t tenant, size_t soft_limit,
+                       size_t hard_limit) {
+    if (alloc->tenants == NULL || TENANT_MAX <= tenant) {
+        return false;
+    }
+
+    alloc->tenants->tenants[tenant].soft_limit = soft_limit;
+    alloc->tenants->tenants[tenant].hard_limit = hard_limit;
+    return true;
+}
+
+// Bytes of heap (boundary tags and padding included) charged to tenant; 0 for
+// no tenant.
+size_t tenant_usage(allocator_t *alloc, uint8_t tenant) {
+    if (alloc->tenants == NULL || TENANT_MAX <= tenant) {
+        return 0;
+    }
+
+    long usage = tenant_total(&alloc->tenants->tenants[tenant]);
+
+    // Read while a share is being folded in, the sum can come out low.
+    return usage < 0 ? 0 : usage;
+}
+
+// Whether tenant would be over limit with another length bytes. The shared
+// total settles it unless it is closer to the limit than the CPUs' shares can
+// add up to, in which case the shares are summed as well.
+static bool tenant_over(allocator_t *alloc, uint8_t tenant, size_t limit,
+                        uint16_t length) {
+    const long slack = (long)TENANT_BATCH * TENANT_CPUS;
+    long usage = atomic_load(&alloc->tenants->tenants[tenant].usage) + length;
+
+    if ((long)limit + slack < usage) {
+        return true;
+    }
+    if (usage + slack <= (long)limit) {
+        return false;
+    }
+    return limit < tenant_usage(alloc, tenant) + length;
+}
+
+// Allocate length bytes charged to tenant. Fails right away if that would
+// take the tenant over its hard limit; over its soft limit, the out-of-memory
+// callback is asked to release memory and an empty heap is purged first. The
+// limits are checked against the block length, as that is what is charged.
+void *tenant_allocate(allocator_t *alloc, uint8_t tenant, uint16_t length) {
+    if (alloc->tenants == NULL || TENANT_MAX <= tenant || length == 0 ||
+        HEAP_SIZE - HEAP_ALIGN - sizeof(raw_boundary_t) < length) {
+        return NULL;
+    }
+
+    tenant_t *t = &alloc->tenants->tenants[tenant];
+    uint16_t block = pad_length(length + sizeof(raw_boundary_t));
+    if (alloc->size_classes) {
+        block = size_class_block(block);
+    }
+
+    if (t->hard_limit != 0 && tenant_over(alloc, tenant, t->hard_limit,
+                                          block)) {
+        atomic_fetch_add(&t->hard_failures, 1);
+        return NULL;
+    }
+
+    if (t->soft_limit != 0 && tenant_over(alloc, tenant, t->soft_limit,
+                                          block)) {
+        atomic_fetch_add(&t->soft_trims, 1);
+        if (alloc->oom != NULL) {
+            alloc->oom(alloc, block, alloc->oom_arg);
+        }
+        allocator_purge(alloc);
+    }
+
+    uint8_t *ptr = allocate_hint(alloc, length, 0);
+    if (ptr == NULL) {
+        return NULL;
+    }
+
+    // A block that was not split keeps the rest of the free block, and may
+    // take the tenant over after all.
+    uint8_t *start = ptr - sizeof(raw_boundary_t);
+    uint16_t charged = raw_length(*raw_at(start));
+    if (block < charged && t->hard_limit != 0 &&
+        tenant_over(alloc, tenant, t->hard_limit, charged)) {
+        deallocate(alloc, ptr);
+        atomic_fetch_add(&t->hard_failures, 1);
+        return NULL;
+    }
+
+    alloc->tenants->owner[granule(alloc, start)] = tenant;
+    tenant_charge(t, charged);
+    return ptr;
+}
+
+void test_allocate(allocator_t *alloc) {
+    const uint16_t length = 1;
+    const uint16_t block_length = 8;
+    const uint16_t blocks = (HEAP_SIZE - HEAP_ALIGN) / block_length;
+    void *ptrs[blocks];
+
+    for (int i = 0; i < blocks; i++) {
+        ptrs[i] = allocate(alloc, length);
+        assert(ptrs[i] != NULL);
+    }
+
+    assert(alloc->allocations == blocks);
+
+    for (int i = 0; i < blocks; i++) {
+        deallocate(alloc, ptrs[i]);
+    }
+
+    assert(alloc->deallocations == blocks);
+
+    raw_boundary_t *boundary_ptr = (raw_boundary_t *)alloc->heap;
+    boundary_t boundary = unpack(*boundary_ptr);
+    assert(boundary.length == HEAP_SIZE - HEAP_ALIGN);
+    assert(boundary.p_alloc);
+    assert(!boundary.alloc);
+}
+
+void test_l_coalesce(allocator_t *alloc) {
+    const uint16_t length =
+        1014; // Allocate 4 blocks that will be 1016 with padding, 4*1016=4064.
+    const uint16_t leftover_length = 22; // 24 bytes leftover, 4088-4064=24.
+    void *ptr1 = allocate(alloc, length);
+    void *ptr2 = allocate(alloc, length);
+    void *ptr3 = allocate(alloc, length);
+    void *ptr4 = allocate(alloc, length);
+    void *ptr5 = allocate(alloc, leftover_length); // To allocate everything.
+
+    // Trigger left coalesce.
+    deallocate(alloc, ptr1);
+    deallocate(alloc, ptr2);
+    assert(alloc->l_coalesce == 1);
+    deallocate(alloc, ptr3);
+    assert(alloc->l_coalesce == 2);
+    deallocate(alloc, ptr4);
+    assert(alloc->l_coalesce == 3);
+    deallocate(alloc, ptr5);
+    assert(alloc->l_coalesce == 4);
+}
+
+void test_r_coalesce(allocator_t *alloc) {
+    const uint16_t length =
+        1014; // Allocate 4 blocks that will be 1016 with padding, 4*1016=4064.
+    const uint16_t leftover_length = 22; // 24 bytes leftover, 4088-4064=24.
+    void *ptr1 = allocate(alloc, length);
+    void *ptr2 = allocate(alloc, length);
+    void *ptr3 = allocate(alloc, length);
+    void *ptr4 = allocate(alloc, length);
+    void *ptr5 = allocate(alloc, leftover_length); // To allocate everything.
+
+    // Trigger right coalesce.
+    deallocate(alloc, ptr5);
+    deallocate(alloc, ptr4);
+    assert(alloc->r_coalesce == 1);
+    deallocate(alloc, ptr3);
+    assert(alloc->r_coalesce == 2);
+    deallocate(alloc, ptr2);
+    assert(alloc->r_coalesce == 3);
+    deallocate(alloc, ptr1);
+    assert(alloc->r_coalesce == 4);
+}
+
+void test_lr_coalesce(allocator_t *alloc) {
+    const uint16_t length =
+        1358; // Allocate 2 blocks that will be 1360 with padding, 2*1360=2720.
+    const uint16_t leftover_length =
+        1366; // 1368 bytes leftover, 4088-2720=1368.
+    void *ptr1 = allocate(alloc, length);
+    void *ptr2 = allocate(alloc, length);
+    void *ptr3 = allocate(alloc, leftover_length); // To allocate everything.
+
+    // Trigger left-right coalesce.
+    deallocate(alloc, ptr1);
+    deallocate(alloc, ptr3);
+    deallocate(alloc, ptr2);
+    assert(alloc->lr_coalesce == 1);
+}
+
+void test_stress(allocator_t *alloc) {
+    const uint16_t MAX_PTRS = (HEAP_SIZE - HEAP_ALIGN) / HEAP_ALIGN;
+    void *ptrs[MAX_PTRS];
+    uint16_t alloc_ptrs = 0;
+
+    for (int i = 0; i < 200000; i++) {
+        if (alloc_ptrs != MAX_PTRS && (alloc_ptrs == 0 || rand() % 2)) {
+            void *p = allocate(alloc, rand() % 256 + 1);
+            if (p != NULL) {
+                ptrs[alloc_ptrs++] = p;
+            }
+            allocator_check(alloc);
+        } else {
+            uint16_t to_deallocate = rand() % alloc_ptrs;
+            deallocate(alloc, ptrs[to_deallocate]);
+            ptrs[to_deallocate] = ptrs[--alloc_ptrs];
+            allocator_check(alloc);
+        }
+    }
+
+    while (0 < alloc_ptrs) {
+        deallocate(alloc, ptrs[--alloc_ptrs]);
+        allocator_check(alloc);
+    }
+}
+
+void test_prefetch_scan(allocator_t *alloc) {
+    alloc->scan = SCAN_PREFETCH;
+
+    // Carve 16-byte blocks and free every other one, leaving 16-byte holes.
+    void *ptrs[32];
+    for (int i = 0; i < 32; i++) {
+        ptrs[i] = allocate(alloc, 14);
+        assert(ptrs[i] != NULL);
+    }
+    for (int i = 0; i < 32; i += 2) {
+        deallocate(alloc, ptrs[i]);
+    }
+    allocator_check(alloc);
+
+    // Too big for every hole; has to come from the block after the last one.
+    assert(allocate(alloc, 30) == (uint8_t *)ptrs[31] + 16);
+    // Fits a hole; first fit means the lowest one.
+    assert(allocate(alloc, 14) == ptrs[0]);
+    allocator_check(alloc);
+
+    allocator_reset(alloc);
+    test_stress(alloc);
+    alloc->scan = SCAN_IMPLICIT;
+}
+
+void test_raw_tags(allocator_t *alloc) {
+    uint8_t *block = alloc->heap;
+    uint16_t length = raw_length(*raw_at(block));
+
+    // A free block has its footer kept in sync.
+    put_p_alloc_raw(block, false);
+    assert(!unpack(*raw_at(block)).p_alloc);
+    assert(*raw_at(block) == *raw_at(block + length - sizeof(raw_boundary_t)));
+    put_p_alloc_raw(block, true);
+    assert(*raw_at(block) == *raw_at(block + length - sizeof(raw_boundary_t)));
+    allocator_check(alloc);
+
+    // An allocated block has no footer, so its payload must be left alone.
+    uint8_t *ptr = allocate(alloc, 6);
+    memset(ptr, 0xab, 6);
+    put_p_alloc_raw(ptr - sizeof(raw_boundary_t), false);
+    assert(!unpack(*raw_at(block)).p_alloc);
+    assert(ptr[4] == 0xab && ptr[5] == 0xab);
+    put_p_alloc_raw(ptr - sizeof(raw_boundary_t), true);
+    allocator_check(alloc);
+}
+
+void test_size_classes(allocator_t *alloc) {
+    alloc->size_classes = true;
+
+    // On an empty heap every block is split to exactly its class length.
+    for (uint16_t length = 1; length <= 256; length++) {
+        uint16_t padded = pad_length(length + sizeof(raw_boundary_t));
+        uint8_t class = SIZE_CLASS_INDEX[padded / HEAP_ALIGN];
+        uint8_t *ptr = allocate(alloc, length);
+        assert(ptr != NULL);
+        boundary_t boundary = unpack(*((raw_boundary_t *)ptr - 1));
+        assert(boundary.length ==
+               (class == SIZE_CLASS_NONE ? padded : SIZE_CLASS_LENGTH[class]));
+        deallocate(alloc, ptr);
+    }
+
+    alloc->size_classes = false;
+
+    // Requests are counted under their unrounded block length; 1 to 6 bytes
+    // all pad to a single granule.
+    assert(alloc->size_hist[1] == 6);
+
+    FILE *out = tmpfile();
+    assert(out != NULL);
+    allocator_stats_dump(alloc, out);
+    alloc->trace = out;
+    void *ptr = allocate(alloc, 10);
+    deallocate(alloc, ptr);
+    alloc->trace = NULL;
+
+    // 33 histogram lines (8 to 264 bytes), then the traced request.
+    char line[64];
+    int histogram_lines = 0;
+    rewind(out);
+    while (fgets(line, sizeof(line), out) != NULL &&
+           strncmp(line, "a ", 2) != 0) {
+        histogram_lines += line[0] == 'h';
+    }
+    assert(histogram_lines == 33);
+    assert(strcmp(line, "a 10 2\n") == 0);
+    assert(fgets(line, sizeof(line), out) != NULL);
+    assert(strcmp(line, "d 2\n") == 0);
+    fclose(out);
+}
+
+void test_allocate_hint(allocator_t *alloc) {
+    uint8_t *epilogue = alloc->heap + (HEAP_SIZE - HEAP_ALIGN);
+
+    // Long-lived objects stack down from the epilogue.
+    uint8_t *permanent = allocate_hint(alloc, 102, ALLOC_PERMANENT);
+    assert(permanent - sizeof(raw_boundary_t) + 104 == epilogue);
+    uint8_t *long_lived = allocate_hint(alloc, 38, ALLOC_LONG);
+    assert(long_lived + 40 == permanent);
+    assert(alloc->top_allocations == 2);
+    allocator_check(alloc);
+
+    // A burst of short-lived objects fills the heap from the bottom up...
+    void *ptrs[64];
+    int n = 0;
+    while (n < 64 && (ptrs[n] = allocate_hint(alloc, 46, ALLOC_SHORT))) {
+        n++;
+    }
+    assert(ptrs[0] == alloc->heap + sizeof(raw_boundary_t));
+    allocator_check(alloc);
+
+    // ...and coalesces back into one run once it is over.
+    for (int i = 0; i < n; i++) {
+        deallocate(alloc, ptrs[i]);
+    }
+    allocator_check(alloc);
+    assert(raw_length(*raw_at(alloc->heap)) == HEAP_SIZE - HEAP_ALIGN - 144);
+
+    // Random hints, including a top allocation that takes a whole block.
+    allocator_reset(alloc);
+    uint16_t live = 0;
+    for (int i = 0; i < 50000; i++) {
+        if (live < 64 && (live == 0 || rand() % 2)) {
+            unsigned flags = rand() % 2 ? ALLOC_SHORT : ALLOC_LONG;
+            void *p = allocate_hint(alloc, rand() % 128 + 1, flags);
+            if (p != NULL) {
+                ptrs[live++] = p;
+            }
+        } else {
+            uint16_t victim = rand() % live;
+            deallocate(alloc, ptrs[victim]);
+            ptrs[victim] = ptrs[--live];
+        }
+        allocator_check(alloc);
+    }
+}
+
+void test_predict(allocator_t *alloc) {
+    assert(allocator_predict_enable(alloc, 512));
+    predictor_t *predict = alloc->predict;
+    uint8_t *keep[16];
+
+    for (int i = 0; i < 16; i++) {
+        // This site's allocations die right away...
+        uint8_t *temporary = allocate(alloc, 24);
+        deallocate(alloc, temporary);
+        // ...while this one's live until the end.
+        keep[i] = allocate(alloc, 24);
+        assert(keep[i] < predict->arena || predict->arena_end <= keep[i]);
+    }
+
+    // Once the first site had enough samples it was moved to the arena, which
+    // was rewound on every deallocation.
+    assert(predict->arena_allocations == 16 - PREDICT_MIN_SAMPLES);
+    assert(predict->arena_resets == predict->arena_allocations);
+    allocator_check(alloc);
+
+    // Double frees and interior pointers are caught in the arena too, even
+    // while other arena blocks are live.
+    uint8_t *site[PREDICT_MIN_SAMPLES + 2];
+    for (int i = 0; i < PREDICT_MIN_SAMPLES + 2; i++) {
+        site[i] = allocate(alloc, 24);
+        if (i < PREDICT_MIN_SAMPLES) {
+            deallocate(alloc, site[i]);
+        }
+    }
+    uint8_t *first = site[PREDICT_MIN_SAMPLES];
+    uint8_t *second = site[PREDICT_MIN_SAMPLES + 1];
+    assert(predict->arena <= first && second < predict->arena_end);
+    size_t invalid_frees = alloc->invalid_frees;
+    alloc->invalid_free = FREE_IGNORE;
+    deallocate(alloc, first);
+    deallocate(alloc, first);
+    deallocate(alloc, second + 8);
+    alloc->invalid_free = FREE_LOG;
+    assert(alloc->invalid_frees == invalid_frees + 2);
+    assert(predict->arena_live == 1);
+    deallocate(alloc, second);
+    assert(predict->arena_live == 0 && predict->bump == predict->arena);
+
+    // A request too long for any heap is refused, even from a site served by
+    // the arena, instead of its padded length wrapping around to 0.
+    // The site is given explicitly, as the compiler may duplicate a call; any
+    // address no allocate() call has will do.
+    char site_marker;
+    void *address = &site_marker;
+    for (int i = 0; i < PREDICT_MIN_SAMPLES; i++) {
+        deallocate(alloc, allocate_predicted(alloc, 16, address));
+    }
+    size_t arena_allocations = predict->arena_allocations;
+    assert(allocate_predicted(alloc, 65530, address) == NULL);
+    assert(predict->arena_live == 0 && predict->bump == predict->arena);
+    uint8_t *ptr = allocate_predicted(alloc, 16, address);
+    assert(predict->arena_allocations == arena_allocations + 1);
+    deallocate(alloc, ptr);
+
+    for (int i = 0; i < 16; i++) {
+        deallocate(alloc, keep[i]);
+    }
+    assert(allocator_predict_disable(alloc));
+    allocator_check(alloc);
+    assert(raw_length(*raw_at(alloc->heap)) == HEAP_SIZE - HEAP_ALIGN);
+}
+
+struct async_producer_t {
+    allocator_t *alloc;
+    void **ptrs;
+    int n;
+};
+
+static void *async_producer(void *arg) {
+    struct async_producer_t *producer = arg;
+
+    for (int i = 0; i < producer->n; i++) {
+        deallocate_async(producer->alloc, producer->ptrs[i]);
+    }
+
+    return NULL;
+}
+
+void test_deallocate_async(allocator_t *alloc) {
+    void *ptrs[2][100];
+
+    for (int i = 0; i < 100; i++) {
+        ptrs[0][i] = allocate(alloc, 14);
+        ptrs[1][i] = allocate(alloc, 14);
+    }
+
+    assert(allocator_async_start(alloc));
+    pthread_t threads[2];
+    struct async_producer_t producers[2];
+    for (int t = 0; t < 2; t++) {
+        producers[t] = (struct async_producer_t){alloc, ptrs[t], 100};
+        pthread_create(&threads[t], NULL, async_producer, &producers[t]);
+    }
+    for (int t = 0; t < 2; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    deallocate_flush(alloc);
+    assert(alloc->deallocations == 200);
+    assert(alloc->deferred->frees + alloc->deferred->overflows == 200);
+    assert(0 < alloc->deferred->batches);
+    allocator_async_stop(alloc);
+
+    // Everything coalesced back into one block.
+    allocator_check(alloc);
+    assert(raw_length(*raw_at(alloc->heap)) == HEAP_SIZE - HEAP_ALIGN);
+}
+
+// Check that the published node is never freed (and reused) under the reader.
+// Payloads are only 2-byte aligned, hence the uint16_t fields.
+static void *epoch_reader(void *arg) {
+    void **args = arg;
+    _Atomic(uint16_t *) *node = args[1];
+    atomic_bool *done = args[2];
+    epoch_thread_t *self = epoch_register(args[0]);
+
+    while (!atomic_load(done)) {
+        uint16_t *current = atomic_load(node);
+        if (current != NULL) {
+            uint16_t value = current[0];
+            for (int j = 1; j < 4; j++) {
+                assert(current[j] == value);
+            }
+        }
+        epoch_quiescent(self);
+        sched_yield();
+    }
+
+    epoch_unregister(self);
+    return NULL;
+}
+
+void test_epoch(allocator_t *alloc) {
+    assert(allocator_epoch_enable(alloc));
+    epoch_thread_t *writer = epoch_register(alloc);
+    epoch_thread_t *reader = epoch_register(alloc);
+
+    void *ptr = allocate(alloc, 14);
+    assert(retire(writer, ptr));
+    // Both threads saw the epoch ptr was retired in, but that is not enough.
+    assert(epoch_collect(writer) == 0);
+    epoch_quiescent(writer);
+    assert(epoch_collect(writer) == 0);
+    // The reader has not passed a quiescent point since.
+    assert(alloc->deallocations == 0);
+    epoch_quiescent(reader);
+    assert(epoch_collect(writer) == 1);
+    assert(alloc->deallocations == 1);
+    assert(atomic_load(&alloc->epoch->advances) == 2);
+
+    // A reader that never reaches a quiescent point holds everything back, and
+    // reclamation runs in batches once it does.
+    for (int i = 0; i < EPOCH_BATCH; i++) {
+        assert(retire(writer, allocate(alloc, 14)));
+        epoch_quiescent(writer);
+    }
+    assert(alloc->deallocations == 1);
+    for (int i = 0; i < 2 * EPOCH_BATCH; i++) {
+        assert(retire(writer, allocate(alloc, 14)));
+        epoch_quiescent(writer);
+        epoch_quiescent(reader);
+    }
+    // The first collection after that moves the epoch on, the second frees
+    // everything retired before it at once.
+    assert(alloc->deallocations == 1 + 2 * EPOCH_BATCH);
+
+    epoch_unregister(writer);
+    epoch_unregister(reader);
+    allocator_epoch_disable(alloc);
+    assert(alloc->allocations == alloc->deallocations);
+    allocator_check(alloc);
+    assert(heap_is_empty(alloc));
+
+    // One thread keeps replacing a published node, two others read it.
+    assert(allocator_epoch_enable(alloc));
+    _Atomic(uint16_t *) node = NULL;
+    atomic_bool done = false;
+    void *args[3] = {alloc, &node, &done};
+    pthread_t threads[2];
+    for (int t = 0; t < 2; t++) {
+        pthread_create(&threads[t], NULL, epoch_reader, args);
+    }
+
+    writer = epoch_register(alloc);
+    for (uint16_t i = 0; i < 2000; i++) {
+        uint16_t *fresh;
+        // The heap is small enough for retired nodes to fill it up.
+        for (;;) {
+            pthread_mutex_lock(&alloc->lock);
+            fresh = allocate(alloc, 4 * sizeof(uint16_t));
+            pthread_mutex_unlock(&alloc->lock);
+            if (fresh != NULL) {
+                break;
+            }
+            epoch_collect(writer);
+            sched_yield();
+        }
+        for (int j = 0; j < 4; j++) {
+            fresh[j] = i;
+        }
+        assert(retire(writer, atomic_exchange(&node, fresh)));
+        epoch_quiescent(writer);
+    }
+    atomic_store(&done, true);
+    for (int t = 0; t < 2; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    assert(retire(writer, atomic_exchange(&node, NULL)));
+    epoch_unregister(writer);
+    assert(0 < atomic_load(&alloc->epoch->reclaimed));
+    allocator_epoch_disable(alloc);
+    assert(alloc->allocations == alloc->deallocations);
+    allocator_check(alloc);
+    assert(heap_is_empty(alloc));
+}
+
+static void *numa_remote_free(void *arg) {
+    void **args = arg;
+    numa_deallocate(args[0], args[1]);
+    return NULL;
+}
+
+void test_numa(void) {
+    numa_arenas_t numa;
+    assert(numa_arenas_init(&numa, 2));
+
+    // This thread and the next are dealt out to different nodes.
+    void *ptr = numa_allocate(&numa, 32);
+    int local = numa_owner(&numa, ptr);
+    assert(0 <= local);
+
+    numa_deallocate(&numa, numa_allocate(&numa, 32));
+    assert(numa.arenas[local].remote_frees == 0);
+
+    pthread_t thread;
+    void *args[] = {&numa, ptr};
+    pthread_create(&thread, NULL, numa_remote_free, args);
+    pthread_join(thread, NULL);
+    assert(numa.arenas[local].remote_frees == 1);
+    assert(numa.arenas[local].deallocations == 2);
+    allocator_check(&numa.arenas[local]);
+
+    // Another set of arenas deals the thread out afresh.
+    numa_arenas_t other;
+    assert(numa_arenas_init(&other, 3));
+    atomic_store(&other.next_node, 2);
+    ptr = numa_allocate(&other, 32);
+    assert(numa_owner(&other, ptr) == 2);
+    numa_deallocate(&other, ptr);
+    assert(other.arenas[2].remote_frees == 0);
+    assert(numa_thread_node(&numa) == local);
+    numa_arenas_deinit(&other);
+
+    numa_arenas_deinit(&numa);
+}
+
+struct heap_worker_t {
+    thread_heaps_t *registry;
+    void *ptrs[3];
+    bool free_before_exit;
+};
+
+static void *heap_worker(void *arg) {
+    struct heap_worker_t *worker = arg;
+
+    for (int i = 0; i < 3; i++) {
+        worker->ptrs[i] = thread_heap_allocate(worker->registry, 100);
+        assert(worker->ptrs[i] != NULL);
+    }
+    if (worker->free_before_exit) {
+        for (int i = 0; i < 3; i++) {
+            thread_heap_deallocate(worker->registry, worker->ptrs[i]);
+        }
+    }
+
+    return NULL;
+}
+
+static thread_heap_t *heap_of(thread_heaps_t *registry, void *ptr) {
+    for (int i = 0; i < THREAD_HEAPS_MAX; i++) {
+        uint8_t *heap = registry->heaps[i].alloc.heap;
+        if (heap <= (uint8_t *)ptr && (uint8_t *)ptr < heap + HEAP_SIZE) {
+            return &registry->heaps[i];
+        }
+    }
+    return NULL;
+}
+
+void test_thread_heaps(void) {
+    thread_heaps_t registry;
+    assert(thread_heaps_init(&registry));
+
+    // The first thread exits with its blocks still live.
+    struct heap_worker_t first = {.registry = &registry};
+    pthread_t thread;
+    pthread_create(&thread, NULL, heap_worker, &first);
+    pthread_join(thread, NULL);
+    thread_heap_t *stranded = heap_of(&registry, first.ptrs[0]);
+    assert(atomic_load(&stranded->state) == HEAP_ABANDONED);
+    assert(atomic_load(&registry.abandons) == 1);
+
+    // The next thread to need memory adopts that heap and reuses it. It frees
+    // its own blocks before exiting, but the first thread's are still there.
+    struct heap_worker_t second = {.registry = &registry,
+                                   .free_before_exit = true};
+    pthread_create(&thread, NULL, heap_worker, &second);
+    pthread_join(thread, NULL);
+    assert(heap_of(&registry, second.ptrs[0]) == stranded);
+    assert(atomic_load(&registry.adoptions) == 1);
+    assert(atomic_load(&stranded->state) == HEAP_ABANDONED);
+
+    // The stranded blocks can still be freed, and coalesce as usual; once
+    // they are gone, so is the abandoned heap.
+    for (int i = 0; i < 3; i++) {
+        thread_heap_deallocate(&registry, first.ptrs[i]);
+    }
+    allocator_check(&stranded->alloc);
+    assert(heap_is_empty(&stranded->alloc));
+    assert(atomic_load(&stranded->state) == HEAP_FREE);
+
+    thread_heaps_deinit(&registry);
+}
+
+struct tcache_worker_t {
+    tcaches_t *shared;
+    bool hoarder; // Frees into its cache; the other frees straight to the heap.
+};
+
+static void *tcache_worker(void *arg) {
+    struct tcache_worker_t *worker = arg;
+    tcache_t *cache = tcache_register(worker->shared);
+    allocator_t *alloc = worker->shared->alloc;
+    void *ptrs[16];
+
+    for (int i = 0; i < 2000; i++) {
+        for (int j = 0; j < 16; j++) {
+            ptrs[j] = tcache_allocate(cache, 20);
+        }
+        for (int j = 0; j < 16; j++) {
+            if (worker->hoarder) {
+                tcache_deallocate(cache, ptrs[j]);
+            } else if (ptrs[j] != NULL) {
+                pthread_mutex_lock(&alloc->lock);
+                deallocate(alloc, ptrs[j]);
+                pthread_mutex_unlock(&alloc->lock);
+            }
+        }
+    }
+
+    tcache_unregister(cache);
+    return NULL;
+}
+
+void test_lazy_init(void) {
+    allocator_t allocs[4];
+    heap_region_t region;
+
+    // Heaps carved from a region are not touched until first used.
+    assert(heap_region_init(&region, 3));
+    for (int i = 0; i < 3; i++) {
+        assert(allocator_init_from(&allocs[i], &region));
+        assert(!allocs[i].formatted);
+        assert(pagemap_lookup(allocs[i].heap + 100) == &allocs[i]);
+    }
+    assert(!allocator_init_from(&allocs[3], &region) && errno == ENOMEM);
+
+    // The first use formats the heap, which is still known to be zero, and
+    // keeps what was set up before it.
+    assert(allocator_isolate_enable(&allocs[0]));
+    void *ptr = allocate_zeroed(&allocs[0], 100);
+    assert(allocs[0].formatted && allocs[0].zeroed_fast == 1);
+    assert(allocs[0].runs != NULL);
+    deallocate(&allocs[0], ptr);
+    allocator_check(&allocs[0]);
+    // Nor do queries format it.
+    assert(heap_is_empty(&allocs[1]) && !allocs[1].formatted);
+    assert(allocator_usable_size(allocs[1].heap + 100) == 0);
+    assert(!allocator_purge(&allocs[1]) && !allocs[1].formatted);
+
+    // A heap given back is handed out again, but not as zero.
+    uint8_t *heap = allocs[1].heap;
+    allocator_deinit(&allocs[1]);
+    assert(pagemap_lookup(heap) == NULL);
+    assert(allocator_init_from(&allocs[1], &region));
+    assert(allocs[1].heap == heap);
+    ptr = allocate_zeroed(&allocs[1], 100);
+    assert(allocs[1].zeroed_slow == 1);
+    deallocate(&allocs[1], ptr);
+    allocator_check(&allocs[1]);
+    for (int i = 0; i < 3; i++) {
+        allocator_deinit(&allocs[i]);
+    }
+    heap_region_deinit(&region);
+
+    // The emergency reserve can be set aside before the first use, whatever
+    // the allocator_t held before.
+    uint8_t *buf = aligned_alloc(HEAP_SIZE, 2 * HEAP_SIZE);
+    memset(&allocs[0], 0xaa, sizeof(allocs[0]));
+    assert(allocator_init_with_buffer(&allocs[0], buf, HEAP_SIZE));
+    assert(allocs[0].reserve == NULL);
+    assert(allocator_reserve(&allocs[0], 64));
+    allocator_check(&allocs[0]);
+    allocator_deinit(&allocs[0]);
+
+    // The caller's buffer must be aligned and long enough, and is left alone
+    // until the first allocation.
+    memset(buf, 0xaa, 2 * HEAP_SIZE);
+    assert(!allocator_init_with_buffer(&allocs[0], buf + HEAP_ALIGN,
+                                       HEAP_SIZE) &&
+           errno == EINVAL);
+    assert(!allocator_init_with_buffer(&allocs[0], buf, HEAP_SIZE - 1) &&
+           errno == EINVAL);
+    assert(allocator_init_with_buffer(&allocs[0], buf, 2 * HEAP_SIZE));
+    assert(allocator_largest_free(&allocs[0]) ==
+           HEAP_SIZE - HEAP_ALIGN - sizeof(raw_boundary_t));
+    assert(heap_is_empty(&allocs[0]));
+    assert(buf[0] == 0xaa && buf[HEAP_SIZE - 1] == 0xaa);
+    ptr = allocate_zeroed(&allocs[0], 100);
+    assert(allocs[0].zeroed_slow == 1);
+    for (int i = 0; i < 100; i++) {
+        assert(((uint8_t *)ptr)[i] == 0);
+    }
+    deallocate(&allocs[0], ptr);
+    allocator_check(&allocs[0]);
+    // The buffer is not anonymous memory, so it is never purged.
+    assert(heap_is_empty(&allocs[0]) && !allocator_purge(&allocs[0]));
+    allocator_deinit(&allocs[0]);
+    assert(buf[HEAP_SIZE] == 0xaa);
+    free(buf);
+}
+
+void test_tcache_warm(allocator_t *alloc) {
+    uint32_t hist[HEAP_GRANULES];
+    void *ptrs[64];
+
+    // A previous run: 30 requests of 20 bytes and 10 of 100.
+    for (int i = 0; i < 40; i++) {
+        deallocate(alloc, allocate(alloc, i < 30 ? 20 : 100));
+    }
+    FILE *stats = tmpfile();
+    allocator_stats_dump(alloc, stats);
+    allocator_reset(alloc);
+    rewind(stats);
+    assert(histogram_read(stats, hist) == 40);
+    fclose(stats);
+
+    // 1024 bytes of the 1760 the histogram asks for, in proportion: 17 blocks
+    // of 24 bytes and 6 of 104, one after the other from the start.
+    tcaches_t shared;
+    tcaches_init(&shared, alloc);
+    tcache_t *cache = tcache_register(&shared);
+    uint8_t small = SIZE_CLASS_INDEX[24 / HEAP_ALIGN];
+    uint8_t large = SIZE_CLASS_INDEX[104 / HEAP_ALIGN];
+    assert(tcache_warm(cache, hist, 1024) == 23);
+    assert(deque_size(&cache->bins[small]) == 17);
+    assert(deque_size(&cache->bins[large]) == 6);
+    int free_blocks = 0;
+    for (int w = 0; w < FREE_MAP_WORDS; w++) {
+        free_blocks += __builtin_popcountll(alloc->free_map[w]);
+    }
+    assert(free_blocks == 1);
+    assert(is_tracked_free(alloc, alloc->heap + 17 * 24 + 6 * 104));
+    allocator_check(alloc);
+
+    // The first requests are all served from the cache.
+    size_t allocations = alloc->allocations;
+    for (int i = 0; i < 23; i++) {
+        ptrs[i] = tcache_allocate(cache, i < 17 ? 20 : 100);
+        assert(ptrs[i] != NULL);
+    }
+    assert(alloc->allocations == allocations);
+    for (int i = 0; i < 23; i++) {
+        tcache_deallocate(cache, ptrs[i]);
+    }
+    tcache_unregister(cache);
+    allocator_check(alloc);
+    assert(heap_is_empty(alloc));
+
+    // Holes too short for any class are passed over.
+    cache = tcache_register(&shared);
+    for (int i = 0; i < 8; i++) {
+        ptrs[i] = allocate(alloc, 14);
+    }
+    for (int i = 0; i < 8; i += 2) {
+        deallocate(alloc, ptrs[i]);
+    }
+    assert(tcache_warm(cache, hist, 240) == 5);
+    for (int i = 0; i < 5; i++) {
+        ptrs[8 + i] = tcache_allocate(cache, i < 4 ? 20 : 100);
+        assert((uint8_t *)ptrs[8 + i] > (uint8_t *)ptrs[7]);
+    }
+    allocator_check(alloc);
+    for (int i = 0; i < 5; i++) {
+        tcache_deallocate(cache, ptrs[8 + i]);
+    }
+    tcache_unregister(cache);
+    for (int i = 1; i < 8; i += 2) {
+        deallocate(alloc, ptrs[i]);
+    }
+    allocator_check(alloc);
+    assert(heap_is_empty(alloc));
+}
+
+void test_tcache(allocator_t *alloc) {
+    tcaches_t shared;
+    tcaches_init(&shared, alloc);
+    tcache_t *full = tcache_register(&shared);
+    tcache_t *dry = tcache_register(&shared);
+    uint8_t class = SIZE_CLASS_INDEX[pad_length(20 + sizeof(raw_boundary_t)) /
+                                     HEAP_ALIGN];
+    void *ptrs[20];
+
+    for (int i = 0; i < 20; i++) {
+        ptrs[i] = tcache_allocate(full, 20);
+    }
+    for (int i = 0; i < 20; i++) {
+        tcache_deallocate(full, ptrs[i]);
+    }
+    assert(deque_size(&full->bins[class]) == 20);
+
+    // The dry cache takes a batch from the full one instead of the heap.
+    size_t allocations = alloc->allocations;
+    void *ptr = tcache_allocate(dry, 20);
+    assert(alloc->allocations == allocations);
+    assert(atomic_load(&alloc->steals) == 1);
+    assert(deque_size(&full->bins[class]) == 20 - TCACHE_STEAL_BATCH);
+    assert(deque_size(&dry->bins[class]) == TCACHE_STEAL_BATCH - 1);
+    tcache_deallocate(dry, ptr);
+
+    // Nobody has blocks of this class to give.
+    size_t steal_failures = atomic_load(&alloc->steal_failures);
+    ptr = tcache_allocate(dry, 100);
+    assert(atomic_load(&alloc->steal_failures) == steal_failures + 1);
+    tcache_deallocate(dry, ptr);
+
+    // A block the cache did not carve goes back to the heap, even if it is as
+    // long as a class.
+    ptr = allocate(alloc, 20);
+    long cached = deque_size(&dry->bins[class]);
+    size_t deallocations = alloc->deallocations;
+    tcache_deallocate(dry, ptr);
+    assert(deque_size(&dry->bins[class]) == cached);
+    assert(alloc->deallocations == deallocations + 1);
+    allocator_check(alloc);
+
+    tcache_unregister(full);
+    tcache_unregister(dry);
+    allocator_check(alloc);
+    assert(heap_is_empty(alloc));
+
+    // One thread hoards freed blocks while the other keeps running dry.
+    pthread_t threads[2];
+    struct tcache_worker_t workers[2] = {{&shared, true}, {&shared, false}};
+    for (int t = 0; t < 2; t++) {
+        pthread_create(&threads[t], NULL, tcache_worker, &workers[t]);
+    }
+    for (int t = 0; t < 2; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    allocator_check(alloc);
+    assert(heap_is_empty(alloc));
+}
+
+void test_invalid_free(allocator_t *alloc) {
+    uint8_t *a = allocate(alloc, 30);
+    uint8_t *b = allocate(alloc, 30);
+    uint8_t *c = allocate(alloc, 30);
+    int local;
+
+    alloc->invalid_free = FREE_IGNORE;
+    deallocate(alloc, b);
+    deallocate(alloc, b);     // Double free.
+    deallocate(alloc, a + 8); // Interior pointer.
+    deallocate(alloc, a + 1); // Misaligned.
+    deallocate(alloc, &local);
+    deallocate(alloc, alloc->heap + (HEAP_SIZE - HEAP_ALIGN) + 2); // Epilogue.
+    assert(alloc->invalid_frees == 5);
+    assert(alloc->deallocations == 1);
+
+    // c is coalesced into the free run after b; neither is a block any more.
+    deallocate(alloc, c);
+    deallocate(alloc, c);
+    deallocate(alloc, b);
+    assert(alloc->invalid_frees == 7);
+    assert(alloc->deallocations == 2);
+    allocator_check(alloc);
+
+    // The same, aborting.
+    alloc->invalid_free = FREE_ABORT;
+    pid_t pid = fork();
+    if (pid == 0) {
+        fclose(stderr);
+        deallocate(alloc, b);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+
+    alloc->invalid_free = FREE_LOG;
+    deallocate(alloc, a);
+    allocator_check(alloc);
+    assert(heap_is_empty(alloc));
+}
+
+#define ISOLATE_THREADS 2
+#define ISOLATE_OBJECTS 24
+
+struct isolate_worker_t {
+    allocator_t *alloc;
+    atomic_int *turn; // Whose allocation is next, counting up.
+    int id;
+    int threads;
+    uint8_t *ptrs[ISOLATE_OBJECTS];
+};
+
+// Allocate 16-byte objects in turn with the other workers, so that first fit
+// places the objects of different threads next to each other.
+static void *isolate_worker(void *arg) {
+    struct isolate_worker_t *worker = arg;
+
+    for (int i = 0; i < ISOLATE_OBJECTS; i++) {
+        while (atomic_load(worker->turn) != i * worker->threads + worker->id) {
+            sched_yield();
+        }
+        pthread_mutex_lock(&worker->alloc->lock);
+        worker->ptrs[i] = allocate(worker->alloc, 16);
+        pthread_mutex_unlock(&worker->alloc->lock);
+        atomic_fetch_add(worker->turn, 1);
+    }
+
+    return NULL;
+}
+
+// Run the workers, and return how many cache lines hold objects of more than
+// one of them.
+static int isolate_run(allocator_t *alloc,
+                       struct isolate_worker_t workers[], int threads) {
+    pthread_t thread[threads];
+    atomic_int turn = 0;
+    int8_t owner[HEAP_SIZE / CACHE_LINE];
+    int shared = 0;
+
+    for (int t = 0; t < threads; t++) {
+        workers[t] = (struct isolate_worker_t){alloc, &turn, t, threads, {0}};
+        pthread_create(&thread[t], NULL, isolate_worker, &workers[t]);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(thread[t], NULL);
+    }
+
+    memset(owner, -1, sizeof(owner));
+    for (int t = 0; t < threads; t++) {
+        for (int i = 0; i < ISOLATE_OBJECTS; i++) {
+            assert(workers[t].ptrs[i] != NULL);
+            int first = (workers[t].ptrs[i] - alloc->heap) / CACHE_LINE;
+            int last = (workers[t].ptrs[i] + 15 - alloc->heap) / CACHE_LINE;
+            for (int line = first; line <= last; line++) {
+                if (owner[line] == -1) {
+                    owner[line] = t;
+                } else if (owner[line] != t && owner[line] != threads) {
+                    shared++;
+                    owner[line] = threads; // Counted once.
+                }
+            }
+        }
+    }
+    return shared;
+}
+
+void test_isolate(allocator_t *alloc) {
+    struct isolate_worker_t workers[ISOLATE_THREADS];
+
+    // Taking turns, two threads share lines under first fit...
+    assert(0 < isolate_run(alloc, workers, ISOLATE_THREADS));
+    for (int t = 0; t < ISOLATE_THREADS; t++) {
+        for (int i = 0; i < ISOLATE_OBJECTS; i++) {
+            deallocate(alloc, workers[t].ptrs[i]);
+        }
+    }
+    assert(heap_is_empty(alloc));
+
+    // ...but never in their own runs, which are line aligned.
+    assert(allocator_isolate_enable(alloc));
+    assert(isolate_run(alloc, workers, ISOLATE_THREADS) == 0);
+    assert(alloc->runs->run_allocations ==
+           ISOLATE_THREADS * ISOLATE_OBJECTS);
+    // 24 objects of 16 bytes take two runs per thread; the first ones are
+    // retired full.
+    assert(alloc->runs->runs_claimed == 2 * ISOLATE_THREADS);
+    for (int t = 0; t < ISOLATE_THREADS; t++) {
+        assert(((uintptr_t)workers[t].ptrs[0] % CACHE_LINE) == 0);
+    }
+    allocator_check(alloc);
+
+    // Larger requests still come from the heap, and the tags are left alone.
+    uint8_t *large = allocate(alloc, RUN_SMALL + 1);
+    assert(is_block_start(alloc, large - sizeof(raw_boundary_t)));
+    deallocate(alloc, large);
+
+    // Double frees and interior pointers are caught in a run too, even while
+    // it has other live objects.
+    uint8_t *first = allocate(alloc, 16);
+    uint8_t *second = allocate(alloc, 16);
+    size_t invalid_frees = alloc->invalid_frees;
+    alloc->invalid_free = FREE_IGNORE;
+    deallocate(alloc, first);
+    deallocate(alloc, first);
+    deallocate(alloc, second + 8);
+    alloc->invalid_free = FREE_LOG;
+    assert(alloc->invalid_frees == invalid_frees + 2);
+    deallocate(alloc, second);
+
+    // Freeing everything gives the retired runs back to the heap; the ones
+    // in use stay, rewound, until isolation is turned off.
+    assert(!allocator_isolate_disable(alloc));
+    size_t deallocations = alloc->deallocations;
+    for (int t = 0; t < ISOLATE_THREADS; t++) {
+        for (int i = 0; i < ISOLATE_OBJECTS; i++) {
+            deallocate(alloc, workers[t].ptrs[i]);
+        }
+    }
+    assert(alloc->deallocations == deallocations + ISOLATE_THREADS);
+    allocator_check(alloc);
+    assert(allocator_isolate_disable(alloc));
+    assert(heap_is_empty(alloc));
+}
+
+// Random small requests, returning how many of them straddled a line.
+static size_t line_workload(allocator_t *alloc) {
+    uint8_t *ptrs[64] = {0};
+
+    srand(72);
+    for (int step = 0; step < 4000; step++) {
+        int i = rand() % 64;
+        if (ptrs[i] == NULL) {
+            ptrs[i] = allocate(alloc, 1 + rand() % 48);
+        } else {
+            deallocate(alloc, ptrs[i]);
+            ptrs[i] = NULL;
+        }
+        allocator_check(alloc);
+    }
+    for (int i = 0; i < 64; i++) {
+        deallocate(alloc, ptrs[i]);
+    }
+    assert(heap_is_empty(alloc));
+
+    size_t straddles = alloc->line_straddles;
+    allocator_reset(alloc);
+    return straddles;
+}
+
+void test_line_aware(allocator_t *alloc) {
+    // The first fit would put the second payload at 50..80, across the line
+    // at 64; line-aware placement carves it from the end of the heap instead.
+    for (int i = 0; i < 2; i++) {
+        alloc->line_aware = i == 1;
+        uint8_t *a = allocate(alloc, 46);
+        uint8_t *b = allocate(alloc, 30);
+        if (alloc->line_aware) {
+            assert(b == alloc->heap + HEAP_SIZE - HEAP_ALIGN - 32 + 2);
+            assert(alloc->line_straddles == 0);
+        } else {
+            assert(b == a + 48);
+            assert(alloc->line_straddles == 1);
+        }
+        allocator_check(alloc);
+        deallocate(alloc, a);
+        deallocate(alloc, b);
+        assert(heap_is_empty(alloc));
+        allocator_reset(alloc);
+    }
+
+    // Over a random workload it avoids most straddles.
+    alloc->line_aware = false;
+    size_t first_fit = line_workload(alloc);
+    alloc->line_aware = true;
+    size_t line_aware = line_workload(alloc);
+    assert(line_aware * 2 < first_fit);
+    alloc->line_aware = false;
+}
+
+// Longest free block, by walking the heap.
+static uint16_t largest_free_walk(allocator_t *alloc) {
+    uint16_t largest = 0;
+
+    for (uint8_t *current = alloc->heap;
+         current < alloc->heap + HEAP_SIZE - HEAP_ALIGN;
+         current += raw_length(*raw_at(current))) {
+        raw_boundary_t raw = *raw_at(current);
+        if (!(raw & RAW_ALLOC) && largest < raw_length(raw)) {
+            largest = raw_length(raw);
+        }
+    }
+    return largest;
+}
+
+void test_free_tree(allocator_t *alloc) {
+    uint8_t *ptrs[64] = {0};
+    uint8_t *mirror[64] = {0};
+    allocator_t plain;
+
+    assert(allocator_largest_free(alloc) ==
+           HEAP_SIZE - HEAP_ALIGN - sizeof(raw_boundary_t));
+
+    // The tree finds the same first fit as the implicit scan, and its root the
+    // longest free block.
+    assert(allocator_init(&plain));
+    alloc->scan = SCAN_TREE;
+    srand(71);
+    for (int step = 0; step < 4000; step++) {
+        int i = rand() % 64;
+        if (ptrs[i] == NULL) {
+            uint16_t length = 1 + rand() % 120;
+            unsigned flags = rand() % 4 == 0 ? ALLOC_LONG : 0;
+            ptrs[i] = allocate_hint(alloc, length, flags);
+            mirror[i] = allocate_hint(&plain, length, flags);
+            assert((ptrs[i] == NULL) == (mirror[i] == NULL));
+            assert(ptrs[i] == NULL ||
+                   ptrs[i] - alloc->heap == mirror[i] - plain.heap);
+        } else {
+            deallocate(alloc, ptrs[i]);
+            deallocate(&plain, mirror[i]);
+            ptrs[i] = mirror[i] = NULL;
+        }
+        uint16_t largest = largest_free_walk(alloc);
+        assert(allocator_largest_free(alloc) ==
+               (largest == 0 ? 0 : largest - sizeof(raw_boundary_t)));
+        allocator_check(alloc);
+    }
+    allocator_deinit(&plain);
+
+    // Admission control: the largest request fits, and nothing longer does.
+    uint16_t largest = allocator_largest_free(alloc);
+    if (largest != 0) {
+        assert(allocate(alloc, largest + 1) == NULL);
+        void *ptr = allocate(alloc, largest);
+        assert(ptr != NULL);
+        deallocate(alloc, ptr);
+    }
+
+    for (int i = 0; i < 64; i++) {
+        deallocate(alloc, ptrs[i]);
+    }
+    allocator_check(alloc);
+    assert(heap_is_empty(alloc));
+    alloc->scan = SCAN_IMPLICIT;
+}
+
+void test_free_index(allocator_t *alloc) {
+    uint8_t *ptrs[64] = {0};
+    uint8_t *mirror[64] = {0};
+    allocator_t plain;
+
+    // The ordered list is a first fit by address, so it picks the same blocks
+    // as the implicit scan of an allocator seeing the same requests.
+    assert(allocator_init(&plain));
+    assert(allocator_index_enable(alloc));
+    alloc->scan = SCAN_ORDERED;
+    allocator_check(alloc);
+    srand(69);
+    for (int step = 0; step < 4000; step++) {
+        int i = rand() % 64;
+        if (ptrs[i] == NULL) {
+            uint16_t length = 1 + rand() % 60;
+            ptrs[i] = allocate(alloc, length);
+            mirror[i] = allocate(&plain, length);
+            assert((ptrs[i] == NULL) == (mirror[i] == NULL));
+            assert(ptrs[i] == NULL ||
+                   ptrs[i] - alloc->heap == mirror[i] - plain.heap);
+        } else {
+            deallocate(alloc, ptrs[i]);
+            deallocate(&plain, mirror[i]);
+            ptrs[i] = mirror[i] = NULL;
+        }
+        allocator_check(alloc);
+    }
+    for (int i = 0; i < 64; i++) {
+        deallocate(alloc, ptrs[i]);
+    }
+    allocator_check(alloc);
+    assert(heap_is_empty(alloc));
+    allocator_deinit(&plain);
+
+    // A request skips every span of holes too short for it, and blocks carved
+    // from the top shrink the free block in place.
+    for (int i = 0; i < 32; i++) {
+        ptrs[i] = allocate(alloc, 14);
+    }
+    for (int i = 0; i < 32; i += 2) {
+        deallocate(alloc, ptrs[i]);
+    }
+    uint8_t *large = allocate(alloc, 62);
+    assert(large == ptrs[31] + 16);
+    uint8_t *top = allocate_hint(alloc, 14, ALLOC_LONG);
+    assert(top == alloc->heap + HEAP_SIZE - HEAP_ALIGN - 16 + 2);
+    allocator_check(alloc);
+    deallocate(alloc, large);
+    deallocate(alloc, top);
+    for (int i = 1; i < 32; i += 2) {
+        deallocate(alloc, ptrs[i]);
+    }
+    allocator_check(alloc);
+    assert(heap_is_empty(alloc));
+
+    // Most blocks are freed or split next to a free block, and are linked in
+    // without a search.
+    assert(alloc->index->searched_inserts < alloc->index->neighbour_inserts);
+    assert(alloc->index->searched_inserts != 0);
+
+    // The index survives a reset.
+    allocator_reset(alloc);
+    allocator_check(alloc);
+    assert(alloc->index->next[0][SKIP_HEAD] == 0);
+
+    allocator_index_disable(alloc);
+    alloc->scan = SCAN_IMPLICIT;
+}
+
+// A request that has to skip several free blocks that are too small still
+// gets a block of its own padded length (the scan used to pad it again at
+// every free block it skipped).
+void test_skip_small_holes(allocator_t *alloc) {
+    for (int scan = SCAN_IMPLICIT; scan <= SCAN_TREE; scan++) {
+        uint8_t *holes[6];
+        uint8_t *fences[6];
+
+        alloc->scan = scan;
+        for (int i = 0; i < 6; i++) {
+            holes[i] = allocate(alloc, 14);
+            fences[i] = allocate(alloc, 14);
+        }
+        for (int i = 0; i < 6; i++) {
+            deallocate(alloc, holes[i]);
+        }
+
+        uint8_t *ptr = allocate(alloc, 30);
+        assert(ptr == fences[5] + 16);
+        assert(raw_length(*raw_at(ptr - sizeof(raw_boundary_t))) == 32);
+        allocator_check(alloc);
+
+        deallocate(alloc, ptr);
+        for (int i = 0; i < 6; i++) {
+            deallocate(alloc, fences[i]);
+        }
+        assert(heap_is_empty(alloc));
+    }
+    alloc->scan = SCAN_IMPLICIT;
+}
+
+void test_split_threshold(allocator_t *alloc) {
+    uint8_t *ptrs[32];
+
+    // A 48-byte hole serving a 32-byte block leaves a 16-byte splinter, unless
+    // the threshold says it is not worth it.
+    for (int i = 0; i < 2; i++) {
+        alloc->split_threshold = i == 0 ? HEAP_ALIGN : 24;
+        ptrs[0] = allocate(alloc, 46);
+        ptrs[1] = allocate(alloc, 46);
+        deallocate(alloc, ptrs[0]);
+        ptrs[0] = allocate(alloc, 30);
+        uint16_t length = raw_length(*raw_at(ptrs[0] - sizeof(raw_boundary_t)));
+        assert(length == (i == 0 ? 32 : 48));
+        assert(alloc->splinters == 1);
+        deallocate(alloc, ptrs[0]);
+        deallocate(alloc, ptrs[1]);
+        allocator_check(alloc);
+    }
+
+    // A threshold below HEAP_ALIGN never splits off a block with no room for
+    // its tags.
+    alloc->split_threshold = 0;
+    ptrs[0] = allocate(alloc, 46);
+    ptrs[1] = allocate(alloc, 46);
+    deallocate(alloc, ptrs[0]);
+    ptrs[0] = allocate(alloc, 46);
+    assert(raw_length(*raw_at(ptrs[0] - sizeof(raw_boundary_t))) == 48);
+    allocator_check(alloc);
+    deallocate(alloc, ptrs[0]);
+    deallocate(alloc, ptrs[1]);
+
+    // Splinters that are never reused make the adaptive threshold go up...
+    alloc->split_threshold = HEAP_ALIGN;
+    alloc->split_adaptive = true;
+    for (int round = 0; round < 64; round++) {
+        for (int i = 0; i < 32; i++) {
+            ptrs[i] = allocate(alloc, 46);
+        }
+        for (int i = 0; i < 32; i += 2) {
+            deallocate(alloc, ptrs[i]);
+            ptrs[i] = allocate(alloc, 30);
+        }
+        for (int i = 0; i < 32; i++) {
+            deallocate(alloc, ptrs[i]);
+        }
+    }
+    assert(alloc->split_threshold == 24);
+    allocator_check(alloc);
+
+    // ...and plenty of requests short enough for them bring it down again.
+    for (int i = 0; i < 4 * SPLIT_WINDOW; i++) {
+        deallocate(alloc, allocate(alloc, 6));
+    }
+    assert(alloc->split_threshold == HEAP_ALIGN);
+    alloc->split_adaptive = false;
+
+    // A recorded trace replays to the same blocks under the same policy.
+    FILE *trace = tmpfile();
+    alloc->trace = trace;
+    for (int i = 0; i < 32; i++) {
+        ptrs[i] = allocate(alloc, i % 2 == 0 ? 46 : 30);
+    }
+    for (int i = 0; i < 32; i += 2) {
+        deallocate(alloc, ptrs[i]);
+    }
+    alloc->trace = NULL;
+    uint64_t free_map[FREE_MAP_WORDS];
+    memcpy(free_map, alloc->free_map, sizeof(free_map));
+    for (int i = 1; i < 32; i += 2) {
+        deallocate(alloc, ptrs[i]);
+    }
+
+    allocator_t replayed;
+    assert(allocator_init(&replayed));
+    rewind(trace);
+    replay_t result = replay_trace(&replayed, trace);
+    assert(result.requests == 32 && result.failures == 0);
+    assert(memcmp(replayed.free_map, free_map, sizeof(free_map)) == 0);
+    assert(replayed.deallocations == 16);
+    allocator_check(&replayed);
+    allocator_deinit(&replayed);
+    fclose(trace);
+    assert(heap_is_empty(alloc));
+}
+
+void test_pagemap(allocator_t *alloc) {
+    int local;
+    void *foreign = malloc(16);
+
+    assert(pagemap_lookup(alloc->heap) == alloc);
+    assert(pagemap_lookup(alloc->heap + HEAP_SIZE - 1) == alloc);
+    assert(pagemap_lookup(&local) == NULL);
+    assert(pagemap_lookup(foreign) == NULL);
+    assert(pagemap_lookup(NULL) == NULL);
+    assert(pagemap_lookup((void *)UINTPTR_MAX) == NULL);
+
+    allocator_t other;
+    assert(allocator_init(&other));
+    uint8_t *heap = other.heap;
+    assert(pagemap_lookup(heap + 8) == &other);
+    allocator_deinit(&other);
+    assert(pagemap_lookup(heap + 8) == NULL);
+
+    // Usable sizes include the padding of the block.
+    void *small = allocate(alloc, 14);
+    void *large = allocate(alloc, 100);
+    assert(allocator_usable_size(small) == 14);
+    assert(allocator_usable_size(large) ==
+           pad_length(100 + sizeof(raw_boundary_t)) - sizeof(raw_boundary_t));
+    assert(allocator_usable_size(foreign) == 0);
+
+    // Only pointers into a heap get freed.
+    assert(!deallocate_checked(foreign));
+    assert(!deallocate_checked(NULL));
+    assert(deallocate_checked(small));
+    assert(deallocate_checked(large));
+    assert(alloc->deallocations == 2);
+    assert(allocator_usable_size(small) == 0);
+    free(foreign);
+    allocator_check(alloc);
+    assert(heap_is_empty(alloc));
+}
+
+// Frees one stashed block per call, like an application dropping a cache.
+static bool oom_release(allocator_t *alloc, uint16_t length, void *arg) {
+    void **stash = arg;
+    (void)length;
+
+    if (*stash == NULL) {
+        return false;
+    }
+    deallocate(alloc, *stash);
+    *stash = NULL;
+    return true;
+}
+
+void test_oom(allocator_t *alloc) {
+    void *ptrs[256];
+    int n = 0;
+
+    // The reserve only comes out once the rest of the heap is gone.
+    assert(allocator_reserve(alloc, 62));
+    assert(!allocator_reserve(alloc, 62));
+    while ((ptrs[n] = allocate(alloc, 14)) != NULL) {
+        n++;
+    }
+    assert(alloc->reserve_releases == 1 && alloc->reserve == NULL);
+    assert(alloc->alloc_failures == 1);
+    assert(n == (HEAP_SIZE - HEAP_ALIGN) / 16);
+
+    // The callback releases one block, which the retry then gets.
+    void *stash = ptrs[--n];
+    alloc->oom = oom_release;
+    alloc->oom_arg = &stash;
+    ptrs[n] = allocate(alloc, 14);
+    assert(ptrs[n++] != NULL);
+    assert(alloc->oom_calls == 1 && alloc->alloc_failures == 1);
+
+    // Nothing left to release.
+    assert(allocate(alloc, 14) == NULL);
+    assert(alloc->oom_calls == 2 && alloc->alloc_failures == 2);
+
+    alloc->oom = NULL;
+    alloc->oom_arg = NULL;
+    for (int i = 0; i < n; i++) {
+        deallocate(alloc, ptrs[i]);
+    }
+    allocator_check(alloc);
+    assert(heap_is_empty(alloc));
+}
+
+static bool oom_count(allocator_t *alloc, uint16_t length, void *arg) {
+    (void)alloc;
+    (void)length;
+    (*(int *)arg)++;
+    return false;
+}
+
+static void *tenant_worker(void *arg) {
+    allocator_t *alloc = arg;
+
+    for (int i = 0; i < 1000; i++) {
+        pthread_mutex_lock(&alloc->lock);
+        void *ptr = tenant_allocate(alloc, 4, i % 64 + 1);
+        pthread_mutex_unlock(&alloc->lock);
+        sched_yield();
+        pthread_mutex_lock(&alloc->lock);
+        deallocate(alloc, ptr);
+        pthread_mutex_unlock(&alloc->lock);
+    }
+
+    return NULL;
+}
+
+void test_tenants(allocator_t *alloc) {
+    void *ptrs[1024 / 16 + 1];
+    int n = 0;
+
+    // Nothing to charge before tenants are enabled, nor beyond TENANT_MAX.
+    assert(tenant_allocate(alloc, 1, 14) == NULL);
+    assert(!tenant_set_limits(alloc, 1, 0, 1024));
+    assert(tenant_usage(alloc, 1) == 0);
+    assert(allocator_tenants_enable(alloc));
+    assert(tenant_allocate(alloc, TENANT_MAX, 14) == NULL);
+    assert(!tenant_set_limits(alloc, TENANT_MAX, 0, 1024));
+    assert(tenant_usage(alloc, 255) == 0);
+
+    // The hard limit stops the tenant, but not the others.
+    assert(tenant_set_limits(alloc, 1, 0, 1024));
+    while ((ptrs[n] = tenant_allocate(alloc, 1, 14)) != NULL) {
+        n++;
+    }
+    assert(n == 1024 / 16);
+    assert(tenant_usage(alloc, 1) == 1024);
+    assert(alloc->tenants->tenants[1].hard_failures == 1);
+    void *other = tenant_allocate(alloc, 2, 14);
+    assert(other != NULL);
+    assert(tenant_usage(alloc, 2) == 16);
+
+    // Freeing credits the tenant the block was charged to.
+    for (int i = 0; i < n; i++) {
+        deallocate(alloc, ptrs[i]);
+    }
+    deallocate(alloc, other);
+    assert(tenant_usage(alloc, 1) == 0 && tenant_usage(alloc, 2) == 0);
+    // Blocks allocated without a tenant are not charged to anyone.
+    deallocate(alloc, allocate(alloc, 14));
+    assert(tenant_usage(alloc, 0) == 0);
+
+    // The soft limit trims, purging the heap while it is empty, and still
+    // lets the allocation through.
+    int oom_calls = 0;
+    alloc->oom = oom_count;
+    alloc->oom_arg = &oom_calls;
+    assert(tenant_set_limits(alloc, 3, 32, 0));
+    size_t purges = alloc->purges;
+    ptrs[0] = tenant_allocate(alloc, 3, 14);
+    ptrs[1] = tenant_allocate(alloc, 3, 14);
+    assert(alloc->tenants->tenants[3].soft_trims == 0);
+    assert(alloc->purges == purges);
+    ptrs[2] = tenant_allocate(alloc, 3, 14);
+    assert(ptrs[2] != NULL);
+    assert(alloc->tenants->tenants[3].soft_trims == 1 && oom_calls == 1);
+    for (int i = 0; i < 3; i++) {
+        deallocate(alloc, ptrs[i]);
+    }
+    assert(tenant_set_limits(alloc, 3, 1, 0));
+    ptrs[0] = tenant_allocate(alloc, 3, 14);
+    assert(alloc->purges == purges + 1);
+    deallocate(alloc, ptrs[0]);
+    alloc->oom = NULL;
+    alloc->oom_arg = NULL;
+
+    // A block that is not split is charged whole, and the hard limit holds
+    // against that length rather than the request's.
+    void *hole = allocate(alloc, 46);
+    void *wall = allocate(alloc, 14);
+    deallocate(alloc, hole);
+    alloc->split_threshold = 64;
+    assert(tenant_set_limits(alloc, 4, 0, 32));
+    assert(tenant_allocate(alloc, 4, 14) == NULL);
+    assert(alloc->tenants->tenants[4].hard_failures == 1);
+    assert(tenant_usage(alloc, 4) == 0);
+    alloc->split_threshold = HEAP_ALIGN;
+    deallocate(alloc, wall);
+
+    // Threads charge and credit the same tenant from whichever CPU they are
+    // on.
+    pthread_t threads[4];
+    for (int t = 0; t < 4; t++) {
+        pthread_create(&threads[t], NULL, tenant_worker, alloc);
+    }
+    for (int t = 0; t < 4; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    assert(tenant_usage(alloc, 4) == 0);
+    allocator_check(alloc);
+    assert(heap_is_empty(alloc));
+}
+
+// Pooled objects are only 2-byte aligned, so nothing here is wider.
+struct pool_obj_t {
+    uint16_t magic;
+    char name[24];
+};
+
+static int pool_live; // Objects constructed and not destroyed yet.
+
+static void pool_obj_ctor(void *obj) {
+    struct pool_obj_t *o = obj;
+    o->magic = 0xbeef;
+    strcpy(o->name, "constructed");
+    pool_live++;
+}
+
+static void pool_obj_dtor(void *obj) {
+    struct pool_obj_t *o = obj;
+    assert(o->magic == 0xbeef);
+    o->magic = 0;
+    pool_live--;
+}
+
+void test_pool(allocator_t *alloc) {
+    pool_t *pool = pool_create(alloc, sizeof(struct pool_obj_t), pool_obj_ctor,
+                               pool_obj_dtor);
+    struct pool_obj_t *objs[100];
+
+    for (int i = 0; i < 100; i++) {
+        objs[i] = pool_get(pool);
+        assert(objs[i]->magic == 0xbeef);
+    }
+    assert(pool->misses == 100 && pool_live == 100);
+
+    // Only POOL_CAPACITY of them stay constructed.
+    for (int i = 0; i < 100; i++) {
+        pool_put(pool, objs[i]);
+    }
+    assert(pool->count == POOL_CAPACITY);
+    assert(pool_live == POOL_CAPACITY);
+    assert(alloc->deallocations == 100 - POOL_CAPACITY);
+
+    // Reuse skips the constructor, and the object is still constructed.
+    size_t allocations = alloc->allocations;
+    for (int i = 0; i < POOL_CAPACITY; i++) {
+        objs[i] = pool_get(pool);
+        assert(strcmp(objs[i]->name, "constructed") == 0);
+    }
+    assert(pool->hits == POOL_CAPACITY);
+    assert(alloc->allocations == allocations);
+    assert(pool_live == POOL_CAPACITY);
+    for (int i = 0; i < POOL_CAPACITY; i++) {
+        pool_put(pool, objs[i]);
+    }
+
+    // Shrinking destroys idle objects and frees their memory.
+    assert(pool_shrink(pool, 16) == POOL_CAPACITY - 16);
+    assert(pool->count == 16 && pool_live == 16);
+    pool_destroy(pool);
+    assert(pool_live == 0);
+    allocator_check(alloc);
+    assert(heap_is_empty(alloc));
+}
+
+static bool is_zero(uint8_t *ptr, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (ptr[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void test_allocate_zeroed(allocator_t *alloc) {
+    // After a reset the old contents are still there.
+    uint8_t *ptr = allocate_zeroed(alloc, 100);
+    assert(is_zero(ptr, 100));
+    assert(alloc->zeroed_slow == 1);
+
+    // Nothing to purge while something is allocated.
+    assert(!allocator_purge(alloc));
+    deallocate(alloc, ptr);
+    assert(allocator_purge(alloc));
+    allocator_check(alloc);
+
+    ptr = allocate_zeroed(alloc, 100);
+    assert(is_zero(ptr, 100));
+    assert(alloc->zeroed_fast == 1);
+    memset(ptr, 0xff, 100);
+    deallocate(alloc, ptr);
+
+    // Same block, now dirty; large enough for the non-temporal clear.
+    ptr = allocate_zeroed(alloc, 3000);
+    assert(is_zero(ptr, 3000));
+    assert(alloc->zeroed_slow == 2);
+    memset(ptr, 0xff, 3000);
+    deallocate(alloc, ptr);
+
+    // Random workload over a clean heap: no stale boundary may ever show up
+    // in a zeroed block.
+    allocator_reset(alloc);
+    assert(allocator_purge(alloc));
+    void *ptrs[64];
+    uint16_t live = 0;
+    for (int i = 0; i < 20000; i++) {
+        if (live < 64 && (live == 0 || rand() % 2)) {
+            uint16_t length = rand() % 128 + 1;
+            bool zeroed = rand() % 2;
+            uint8_t *p = zeroed ? allocate_zeroed(alloc, length)
+                                : allocate(alloc, length);
+            if (p == NULL) {
+                continue;
+            }
+            assert(!zeroed || is_zero(p, length));
+            memset(p, 0xff, length);
+            ptrs[live++] = p;
+        } else {
+            uint16_t victim = rand() % live;
+            deallocate(alloc, ptrs[victim]);
+            ptrs[victim] = ptrs[--live];
+        }
+        allocator_check(alloc);
+    }
+    assert(0 < alloc->zeroed_fast && 0 < alloc->zeroed_slow);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Time a first fit that has to get past 200 blocks (50 of them free holes) on
+// enough heaps that together they do not fit in the last-level cache, visited
+// in random order so that every scan starts cold.
+void bench_scan(void) {
+    const size_t heaps = 32768; // 128 MiB of heap.
+    const int rounds = 4;
+    allocator_t *allocs = malloc(heaps * sizeof(allocator_t));
+    size_t *order = malloc(heaps * sizeof(size_t));
+    void *ptrs[200];
+
+    for (size_t i = 0; i < heaps; i++) {
+        if (!allocator_init(&allocs[i])) {
+            perror("allocator_init");
+            exit(EXIT_FAILURE);
+        }
+        for (int j = 0; j < 200; j++) {
+            ptrs[j] = allocate(&allocs[i], 14);
+        }
+        for (int j = 0; j < 200; j += 4) {
+            deallocate(&allocs[i], ptrs[j]);
+        }
+        order[i] = i;
+    }
+    for (size_t i = heaps - 1; 0 < i; i--) {
+        size_t j = rand() % (i + 1);
+        size_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    const scan_t scans[] = {SCAN_IMPLICIT, SCAN_PREFETCH, SCAN_TREE};
+    const char *names[] = {"implicit", "prefetch", "tree"};
+    for (int m = 0; m < 3; m++) {
+        size_t failed = 0;
+        for (size_t i = 0; i < heaps; i++) {
+            allocs[i].scan = scans[m];
+        }
 
-void *allocate(allocator_t *alloc, uint16_t length) {
-    // Unless positive length, ignore request.
-    if (length == 0) {
-        return NULL;
+        double start = now_ns();
+        for (int r = 0; r < rounds; r++) {
+            for (size_t i = 0; i < heaps; i++) {
+                allocator_t *alloc = &allocs[order[i]];
+                void *p = allocate(alloc, 40);
+                failed += p == NULL;
+                deallocate(alloc, p);
+            }
+        }
+        double elapsed = now_ns() - start;
+
+        printf("scan %-8s %7.1f ns/op (%zu failed)\n", names[m],
+               elapsed / (rounds * heaps), failed);
     }
 
-    // Find a find a free block sufficiently big
-    uint8_t *current = alloc->heap;
+    for (size_t i = 0; i < heaps; i++) {
+        allocator_deinit(&allocs[i]);
+    }
+    free(order);
+    free(allocs);
+}
 
-    while (current < alloc->heap + (HEAP_SIZE - HEAP_ALIGN)) {
-        boundary_t boundary = unpack(*((raw_boundary_t *)current));
+// Measures a benchmark section in nanoseconds and, where perf_event_open is
+// available, in user-space instructions retired (fd is -1 otherwise).
+struct bench_counter_t {
+    int fd;
+    double start;
+    double ns;
+    uint64_t instructions;
+};
 
-        // Block already allocated; move on.
-        if (boundary.alloc) {
-            current += boundary.length;
-            continue;
-        }
+typedef struct bench_counter_t bench_counter_t;
 
-        // Block is free.
+static void counter_open(bench_counter_t *counter) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    counter->fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
 
-        // Block too small; move on.
-        length = pad_length(length + sizeof(raw_boundary_t));
+static void counter_start(bench_counter_t *counter) {
+    if (0 <= counter->fd) {
+        ioctl(counter->fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter->fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    counter->start = now_ns();
+}
 
-        if (boundary.length < length) {
-            current += boundary.length;
-            continue;
+static void counter_stop(bench_counter_t *counter) {
+    counter->ns = now_ns() - counter->start;
+    counter->instructions = 0;
+    if (0 <= counter->fd) {
+        ioctl(counter->fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter->fd, &counter->instructions,
+                 sizeof(counter->instructions)) < 0) {
+            counter->instructions = 0;
         }
-
-        // Block is free and big enough.
-
-        // Remaining size of block not big enough for splitting; just set the
-        // alloc bit to true. No splitting either exactly when space left is
-        // enough for header and footer; we don't want 0-size free blocks.
-        if (boundary.length - length <= sizeof(raw_boundary_t) * 2) {
-            boundary.alloc = true;
-            put_boundaries(current, boundary);
-            // Update p_alloc of next block (status changed to alloc = true).
-            update_p_alloc(alloc, current, boundary);
-            alloc->available -= boundary.length;
-            alloc->allocations++;
-            return current + sizeof(raw_boundary_t);
-        }
-
-        // Split off remaining block into new free block.
-        // Do not have to update next block's p_alloc because it is still free.
-        boundary_t n_boundary = {
-            .length = boundary.length - length,
-            .p_alloc = true,
-            .alloc = false,
-        };
-        put_boundaries(current + length, n_boundary);
-
-        // Set header of newly allocated block.
-        boundary.length = length;
-        boundary.alloc = true;
-        put_boundaries(current, boundary);
-        alloc->available -= boundary.length;
-        alloc->allocations++;
-        return current + sizeof(raw_boundary_t);
     }
+}
 
-    return NULL;
+static void counter_report(bench_counter_t *counter, const char *name,
+                           size_t ops) {
+    if (0 <= counter->fd) {
+        printf("%-24s %6.2f ns/op %7.1f insns/op\n", name, counter->ns / ops,
+               (double)counter->instructions / ops);
+    } else {
+        printf("%-24s %6.2f ns/op (no instruction counter)\n", name,
+               counter->ns / ops);
+    }
 }
 
-void deallocate(allocator_t *alloc, void *ptr) {
-    // Ignore NULL pointers
-    if (ptr == NULL) {
-        return;
+// Keep the compiler from merging or hoisting the stores of a benchmark loop.
+#define BENCH_BARRIER() __asm__ volatile("" ::: "memory")
+
+// Compare the unpack/pack tag writes with the raw tag fast path, and time the
+// allocate/deallocate pair built on the latter.
+void bench_tags(void) {
+    const size_t ops = 10000000;
+    allocator_t alloc;
+    bench_counter_t counter;
+
+    if (!allocator_init(&alloc)) {
+        perror("allocator_init");
+        exit(EXIT_FAILURE);
     }
+    counter_open(&counter);
+    uint8_t *block = alloc.heap;
+    uint16_t length = HEAP_SIZE - HEAP_ALIGN;
 
-    raw_boundary_t *boundary_ptr = ptr;
-    boundary_ptr -= 1; // Move back to header.
-    boundary_t boundary = unpack(*boundary_ptr);
+    // As in the allocate/deallocate paths, the block whose p_alloc changes is
+    // allocated.
+    uint8_t *next = block + HEAP_ALIGN;
+    *raw_at(next) = (HEAP_ALIGN << 2) | RAW_ALLOC;
 
-    // Do not free an already free block.
-    if (!boundary.alloc) {
-        DBG("Tried to free an already free block at %p", ptr);
-        return;
+    counter_start(&counter);
+    for (size_t i = 0; i < ops; i++) {
+        boundary_t boundary = unpack(*raw_at(next));
+        boundary.p_alloc = i & 1;
+        put_boundaries(next, boundary);
+        BENCH_BARRIER();
     }
+    counter_stop(&counter);
+    counter_report(&counter, "p_alloc unpack/pack", ops);
 
-    // Do not free epilogue block.
-    if ((uint8_t *)boundary_ptr == alloc->heap + (HEAP_SIZE - HEAP_ALIGN)) {
-        DBG("Tried to free epilogue block");
-        return;
+    counter_start(&counter);
+    for (size_t i = 0; i < ops; i++) {
+        if (i & 1) {
+            *raw_at(next) |= RAW_P_ALLOC;
+        } else {
+            *raw_at(next) &= ~RAW_P_ALLOC;
+        }
+        BENCH_BARRIER();
     }
+    counter_stop(&counter);
+    counter_report(&counter, "p_alloc mask", ops);
 
-    raw_boundary_t *n_boundary_ptr =
-        (raw_boundary_t *)((uint8_t *)boundary_ptr + boundary.length);
-    boundary_t n_boundary = unpack(*n_boundary_ptr);
+    counter_start(&counter);
+    for (size_t i = 0; i < ops; i++) {
+        boundary_t boundary = {
+            .length = length, .p_alloc = i & 1, .alloc = false};
+        put_boundaries(block, boundary);
+        BENCH_BARRIER();
+    }
+    counter_stop(&counter);
+    counter_report(&counter, "free tags put_boundaries", ops);
 
-    // Both of the adjacent blocks are allocated; no coalescing.
-    if (boundary.p_alloc && n_boundary.alloc) {
-        boundary.alloc = false;
-        put_boundaries((uint8_t *)boundary_ptr, boundary);
-        update_p_alloc(alloc, (uint8_t *)boundary_ptr, boundary);
+    counter_start(&counter);
+    for (size_t i = 0; i < ops; i++) {
+        put_free_raw(block, (length << 2) | ((i & 1) << 1));
+        BENCH_BARRIER();
     }
+    counter_stop(&counter);
+    counter_report(&counter, "free tags raw", ops);
 
-    // The previous block is free but the next allocated; coalescing to the
-    // left.
-    else if (!boundary.p_alloc && n_boundary.alloc) {
-        raw_boundary_t *p_boundary_ptr =
-            boundary_ptr - 1; // Move back to footer of previous block (we know
-                              // it has one because it's free).
-        boundary_t p_boundary = unpack(*p_boundary_ptr);
-        p_boundary_ptr =
-            (raw_boundary_t *)((uint8_t *)p_boundary_ptr - p_boundary.length) +
-            1; // Move to header of previous block.
-        boundary.length += p_boundary.length;
-        boundary.p_alloc = p_boundary.p_alloc;
-        boundary.alloc = false;
-        put_boundaries((uint8_t *)p_boundary_ptr, boundary);
-        update_p_alloc(alloc, (uint8_t *)p_boundary_ptr, boundary);
-        alloc->l_coalesce++;
+    allocator_reset(&alloc);
+    void *left = allocate(&alloc, 14);
+    void *middle = allocate(&alloc, 14);
+    allocate(&alloc, 14);
+    deallocate(&alloc, left);
+
+    counter_start(&counter);
+    for (size_t i = 0; i < ops; i++) {
+        // Freeing the middle block coalesces it on the left.
+        deallocate(&alloc, middle);
+        middle = allocate(&alloc, 14);
+        BENCH_BARRIER();
     }
+    counter_stop(&counter);
+    counter_report(&counter, "deallocate+allocate", ops);
 
-    // The previous block is allocated, but the next free; coalescing to the
-    // right.
-    else if (boundary.p_alloc && !n_boundary.alloc) {
-        boundary.length += n_boundary.length;
-        boundary.alloc = false;
-        put_boundaries((uint8_t *)boundary_ptr, boundary);
-        // Do not need to update p_block of next block because it hasn't changed
-        // (free -> free).
-        alloc->r_coalesce++;
+    if (0 <= counter.fd) {
+        close(counter.fd);
     }
+    allocator_deinit(&alloc);
+}
 
-    // Both of the adjacent blocks are free; coalescing to both sides.
-    else {
-        raw_boundary_t *p_boundary_ptr =
-            boundary_ptr - 1; // Move back to footer of previous block.
-        boundary_t p_boundary = unpack(*p_boundary_ptr);
-        p_boundary_ptr =
-            (raw_boundary_t *)((uint8_t *)p_boundary_ptr - p_boundary.length) +
-            1; // Move back to header of previous block.
-        boundary.length += p_boundary.length + n_boundary.length;
-        boundary.p_alloc = p_boundary.p_alloc;
-        boundary.alloc = false;
-        put_boundaries((uint8_t *)p_boundary_ptr, boundary);
-        // Again, do not need to update p_block of next block because it went
-        // from free -> free.
-        alloc->lr_coalesce++;
+struct numa_worker_t {
+    numa_arenas_t *numa;
+    int remote_percent; // Share of blocks handed to whichever thread is next.
+    size_t ops;
+};
+
+// Blocks handed between the threads of the NUMA benchmark.
+static _Atomic(void *) numa_exchange[64];
+
+static void *numa_worker(void *arg) {
+    struct numa_worker_t *worker = arg;
+
+    for (size_t i = 0; i < worker->ops; i++) {
+        void *ptr = numa_allocate(worker->numa, 32);
+        if ((int)(i % 100) < worker->remote_percent) {
+            ptr = atomic_exchange(&numa_exchange[i % 64], ptr);
+        }
+        numa_deallocate(worker->numa, ptr);
     }
 
-    alloc->deallocations++;
-    alloc->available += boundary.length;
+    return NULL;
 }
 
-void test_allocate(allocator_t *alloc) {
-    const uint16_t length = 1;
-    const uint16_t block_length = 8;
-    const uint16_t blocks = (HEAP_SIZE - HEAP_ALIGN) / block_length;
-    void *ptrs[blocks];
+// Threads allocating and freeing through the NUMA arenas, with a share of the
+// blocks freed by another thread. Runs on the host's topology if it has
+// several nodes, and on a fake two-node one otherwise.
+void bench_numa(void) {
+    const size_t ops = 1000000;
+    numa_arenas_t numa;
 
-    for (int i = 0; i < blocks; i++) {
-        ptrs[i] = allocate(alloc, length);
-        assert(ptrs[i] != NULL);
+    if (!numa_arenas_init(&numa, 0)) {
+        perror("numa_arenas_init");
+        exit(EXIT_FAILURE);
+    }
+    if (numa.nodes < 2) {
+        numa_arenas_deinit(&numa);
+        if (!numa_arenas_init(&numa, 2)) {
+            perror("numa_arenas_init");
+            exit(EXIT_FAILURE);
+        }
     }
 
-    assert(alloc->allocations == blocks);
+    const int remote_percents[] = {0, 10, 50};
+    for (int r = 0; r < 3; r++) {
+        int threads = numa.nodes * 2;
+        pthread_t thread[NUMA_MAX_NODES * 2];
+        struct numa_worker_t worker = {&numa, remote_percents[r], ops};
+        size_t remote_frees = 0;
 
-    for (int i = 0; i < blocks; i++) {
-        deallocate(alloc, ptrs[i]);
-    }
+        for (int node = 0; node < numa.nodes; node++) {
+            remote_frees -= numa.arenas[node].remote_frees;
+        }
 
-    assert(alloc->deallocations == blocks);
+        double start = now_ns();
+        for (int t = 0; t < threads; t++) {
+            pthread_create(&thread[t], NULL, numa_worker, &worker);
+        }
+        for (int t = 0; t < threads; t++) {
+            pthread_join(thread[t], NULL);
+        }
+        double elapsed = now_ns() - start;
 
-    raw_boundary_t *boundary_ptr = (raw_boundary_t *)alloc->heap;
-    boundary_t boundary = unpack(*boundary_ptr);
-    assert(boundary.length == HEAP_SIZE - HEAP_ALIGN);
-    assert(boundary.p_alloc);
-    assert(!boundary.alloc);
-}
+        for (int i = 0; i < 64; i++) {
+            numa_deallocate(&numa, atomic_exchange(&numa_exchange[i], NULL));
+        }
+        for (int node = 0; node < numa.nodes; node++) {
+            remote_frees += numa.arenas[node].remote_frees;
+        }
 
-void test_l_coalesce(allocator_t *alloc) {
-    const uint16_t length =
-        1014; // Allocate 4 blocks that will be 1016 with padding, 4*1016=4064.
-    const uint16_t leftover_length = 22; // 24 bytes leftover, 4088-4064=24.
-    void *ptr1 = allocate(alloc, length);
-    void *ptr2 = allocate(alloc, length);
-    void *ptr3 = allocate(alloc, length);
-    void *ptr4 = allocate(alloc, length);
-    void *ptr5 = allocate(alloc, leftover_length); // To allocate everything.
+        printf("numa %d nodes%s, %2d%% handed off %7.1f ns/op, %zu remote "
+               "frees\n",
+               numa.nodes, numa.fake ? " (fake)" : "", remote_percents[r],
+               elapsed / (threads * ops), remote_frees);
+    }
 
-    // Trigger left coalesce.
-    deallocate(alloc, ptr1);
-    deallocate(alloc, ptr2);
-    assert(alloc->l_coalesce == 1);
-    deallocate(alloc, ptr3);
-    assert(alloc->l_coalesce == 2);
-    deallocate(alloc, ptr4);
-    assert(alloc->l_coalesce == 3);
-    deallocate(alloc, ptr5);
-    assert(alloc->l_coalesce == 4);
+    numa_arenas_deinit(&numa);
 }
 
-void test_r_coalesce(allocator_t *alloc) {
-    const uint16_t length =
-        1014; // Allocate 4 blocks that will be 1016 with padding, 4*1016=4064.
-    const uint16_t leftover_length = 22; // 24 bytes leftover, 4088-4064=24.
-    void *ptr1 = allocate(alloc, length);
-    void *ptr2 = allocate(alloc, length);
-    void *ptr3 = allocate(alloc, length);
-    void *ptr4 = allocate(alloc, length);
-    void *ptr5 = allocate(alloc, leftover_length); // To allocate everything.
+#define ISOLATE_ROUNDS 1000000
 
-    // Trigger right coalesce.
-    deallocate(alloc, ptr5);
-    deallocate(alloc, ptr4);
-    assert(alloc->r_coalesce == 1);
-    deallocate(alloc, ptr3);
-    assert(alloc->r_coalesce == 2);
-    deallocate(alloc, ptr2);
-    assert(alloc->r_coalesce == 3);
-    deallocate(alloc, ptr1);
-    assert(alloc->r_coalesce == 4);
+// Write to each of the worker's objects ISOLATE_ROUNDS times.
+static void *isolate_hammer(void *arg) {
+    struct isolate_worker_t *worker = arg;
+
+    for (size_t r = 0; r < ISOLATE_ROUNDS; r++) {
+        for (int i = 0; i < ISOLATE_OBJECTS; i++) {
+            (*(volatile uint8_t *)worker->ptrs[i])++;
+        }
+    }
+
+    return NULL;
 }
 
-void test_lr_coalesce(allocator_t *alloc) {
-    const uint16_t length =
-        1358; // Allocate 2 blocks that will be 1360 with padding, 2*1360=2720.
-    const uint16_t leftover_length =
-        1366; // 1368 bytes leftover, 4088-2720=1368.
-    void *ptr1 = allocate(alloc, length);
-    void *ptr2 = allocate(alloc, length);
-    void *ptr3 = allocate(alloc, leftover_length); // To allocate everything.
+// Four threads take turns allocating small objects and then keep writing to
+// them, with and without per-thread runs; false sharing shows up as a higher
+// time per write where the threads really run in parallel.
+void bench_isolate(void) {
+    const int threads = 4;
+    struct isolate_worker_t workers[4];
 
-    // Trigger left-right coalesce.
-    deallocate(alloc, ptr1);
-    deallocate(alloc, ptr3);
-    deallocate(alloc, ptr2);
-    assert(alloc->lr_coalesce == 1);
+    for (int isolate = 0; isolate < 2; isolate++) {
+        allocator_t alloc;
+        pthread_t thread[4];
+
+        if (!allocator_init(&alloc) ||
+            (isolate && !allocator_isolate_enable(&alloc))) {
+            perror("allocator_init");
+            exit(EXIT_FAILURE);
+        }
+        int shared = isolate_run(&alloc, workers, threads);
+
+        double start = now_ns();
+        for (int t = 0; t < threads; t++) {
+            pthread_create(&thread[t], NULL, isolate_hammer, &workers[t]);
+        }
+        for (int t = 0; t < threads; t++) {
+            pthread_join(thread[t], NULL);
+        }
+        double elapsed = now_ns() - start;
+
+        printf("isolate %-3s %5.2f ns/write, %d shared lines\n",
+               isolate ? "on" : "off",
+               elapsed / ((double)threads * ISOLATE_ROUNDS * ISOLATE_OBJECTS),
+               shared);
+        allocator_deinit(&alloc);
+    }
 }
 
-void test_stress(allocator_t *alloc) {
-    const uint16_t MAX_PTRS = (HEAP_SIZE - HEAP_ALIGN) / HEAP_ALIGN;
-    void *ptrs[MAX_PTRS];
-    uint16_t alloc_ptrs = 0;
+// Set up and tear down many heaps, each with its own mapping, carved from one
+// region, and in the caller's memory. The first allocation, which formats a
+// lazily set up heap, is timed apart.
+void bench_init(void) {
+    const size_t heaps = 4096;
+    allocator_t *allocs = malloc(heaps * sizeof(allocator_t));
+    heap_region_t region;
+    uint8_t *buf = aligned_alloc(HEAP_SIZE, heaps * HEAP_SIZE);
 
-    for (int i = 0; i < 200000; i++) {
-        if (alloc_ptrs != MAX_PTRS && (alloc_ptrs == 0 || rand() % 2)) {
-            void *p = allocate(alloc, rand() % 256 + 1);
-            if (p != NULL) {
-                ptrs[alloc_ptrs++] = p;
+    if (allocs == NULL || buf == NULL || !heap_region_init(&region, heaps)) {
+        perror("bench_init");
+        exit(EXIT_FAILURE);
+    }
+
+    const char *names[] = {"mmap", "region", "buffer"};
+    for (int m = 0; m < 3; m++) {
+        double start = now_ns();
+        for (size_t i = 0; i < heaps; i++) {
+            bool ok = m == 0   ? allocator_init(&allocs[i])
+                      : m == 1 ? allocator_init_from(&allocs[i], &region)
+                               : allocator_init_with_buffer(
+                                     &allocs[i], buf + i * HEAP_SIZE,
+                                     HEAP_SIZE);
+            if (!ok) {
+                perror("allocator_init");
+                exit(EXIT_FAILURE);
             }
-            allocator_check(alloc);
-        } else {
-            uint16_t to_deallocate = rand() % alloc_ptrs;
-            deallocate(alloc, ptrs[to_deallocate]);
-            ptrs[to_deallocate] = ptrs[--alloc_ptrs];
-            allocator_check(alloc);
         }
+        double init = now_ns() - start;
+
+        start = now_ns();
+        for (size_t i = 0; i < heaps; i++) {
+            deallocate(&allocs[i], allocate(&allocs[i], 16));
+        }
+        double first = now_ns() - start;
+
+        for (size_t i = 0; i < heaps; i++) {
+            allocator_deinit(&allocs[i]);
+        }
+        printf("init %-6s %8.1f ns/heap, first allocation %7.1f ns\n",
+               names[m], init / heaps, first / heaps);
     }
 
-    while (0 < alloc_ptrs) {
-        deallocate(alloc, ptrs[--alloc_ptrs]);
-        allocator_check(alloc);
+    heap_region_deinit(&region);
+    free(buf);
+    free(allocs);
+}
+
+struct bench_t {
+    const char *name;
+    void (*run)(void);
+};
+
+static const struct bench_t BENCHES[] = {
+    {"scan", bench_scan},
+    {"tags", bench_tags},
+    {"numa", bench_numa},
+    {"isolate", bench_isolate},
+    {"init", bench_init},
+};
+
+// Replay the trace in path under a range of split thresholds and the adaptive
+// one, to compare them on a real workload.
+int replay(const char *path) {
+    const uint16_t thresholds[] = {8, 16, 24, 32, 0}; // 0 for adaptive.
+    FILE *in = fopen(path, "r");
+
+    if (in == NULL) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < sizeof(thresholds) / sizeof(thresholds[0]); i++) {
+        allocator_t alloc;
+        if (!allocator_init(&alloc)) {
+            perror("allocator_init");
+            fclose(in);
+            return EXIT_FAILURE;
+        }
+        alloc.invalid_free = FREE_IGNORE;
+        alloc.split_threshold = thresholds[i] != 0 ? thresholds[i] : HEAP_ALIGN;
+        alloc.split_adaptive = thresholds[i] == 0;
+
+        rewind(in);
+        replay_t result = replay_trace(&alloc, in);
+        if (alloc.split_adaptive) {
+            printf("adaptive (ended at %2u)", alloc.split_threshold);
+        } else {
+            printf("split threshold %2u    ", alloc.split_threshold);
+        }
+        printf(": %zu requests, %zu failed, %.1f free blocks per request, "
+               "%zu splinters (%zu reused)\n",
+               result.requests, result.failures,
+               result.requests == 0
+                   ? 0.0
+                   : (double)result.free_blocks / result.requests,
+               alloc.splinters, alloc.splinters_reused);
+        allocator_deinit(&alloc);
     }
+
+    fclose(in);
+    return 0;
 }
 
-int main(void) {
+int main(int argc, char **argv) {
+    // ./allocator bench [name]: run all benchmarks, or just the one named.
+    if (1 < argc && strcmp(argv[1], "bench") == 0) {
+        for (size_t i = 0; i < sizeof(BENCHES) / sizeof(BENCHES[0]); i++) {
+            if (argc < 3 || strcmp(argv[2], BENCHES[i].name) == 0) {
+                BENCHES[i].run();
+            }
+        }
+        return 0;
+    }
+
+    // ./allocator replay <trace>: compare split thresholds on a trace.
+    if (1 < argc && strcmp(argv[1], "replay") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "usage: %s replay <trace>\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        return replay(argv[2]);
+    }
+
     allocator_t alloc;
-    allocator_init(&alloc);
+    if (!allocator_init(&alloc)) {
+        perror("allocator_init");
+        return EXIT_FAILURE;
+    }
 
     test_allocate(&alloc);
     allocator_reset(&alloc);
@@ -461,6 +5666,75 @@ int main(void) {
     test_stress(&alloc);
     allocator_reset(&alloc);
 
+    test_prefetch_scan(&alloc);
+    allocator_reset(&alloc);
+
+    test_raw_tags(&alloc);
+    allocator_reset(&alloc);
+
+    test_size_classes(&alloc);
+    allocator_reset(&alloc);
+
+    test_allocate_zeroed(&alloc);
+    allocator_reset(&alloc);
+
+    test_allocate_hint(&alloc);
+    allocator_reset(&alloc);
+
+    test_predict(&alloc);
+    allocator_reset(&alloc);
+
+    test_deallocate_async(&alloc);
+    allocator_reset(&alloc);
+
+    test_epoch(&alloc);
+    allocator_reset(&alloc);
+
+    test_numa();
+
+    test_thread_heaps();
+
+    test_tcache(&alloc);
+    allocator_reset(&alloc);
+
+    test_tcache_warm(&alloc);
+    allocator_reset(&alloc);
+
+    test_pool(&alloc);
+    allocator_reset(&alloc);
+
+    test_oom(&alloc);
+    allocator_reset(&alloc);
+
+    test_tenants(&alloc);
+    allocator_reset(&alloc);
+
+    test_pagemap(&alloc);
+    allocator_reset(&alloc);
+
+    test_invalid_free(&alloc);
+    allocator_reset(&alloc);
+
+    test_split_threshold(&alloc);
+    allocator_reset(&alloc);
+
+    test_skip_small_holes(&alloc);
+    allocator_reset(&alloc);
+
+    test_free_index(&alloc);
+    allocator_reset(&alloc);
+
+    test_free_tree(&alloc);
+    allocator_reset(&alloc);
+
+    test_line_aware(&alloc);
+    allocator_reset(&alloc);
+
+    test_isolate(&alloc);
+    allocator_reset(&alloc);
+
+    test_lazy_init();
+
     allocator_deinit(&alloc);
 
     return 0;
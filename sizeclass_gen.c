@@ -0,0 +1,185 @@
+// Compute size classes for the allocator from a recorded workload.
+//
+// Reads an allocation trace (as written through allocator_t.trace) and/or the
+// histogram lines of allocator_stats_dump, and picks the class boundaries that
+// minimise the internal fragmentation caused by rounding each padded block up
+// to its class. The result is printed as a header to be saved as
+// size_classes.h.
+//
+// Usage: sizeclass_gen [-n classes] [file...]
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Must match allocator.c.
+#define HEAP_ALIGN 8
+#define HEAP_GRANULES 512
+#define BOUNDARY_SIZE 2
+
+#define MAX_CLASSES 64
+#define SIZE_CLASS_NONE 0xff
+
+static uint64_t hist[HEAP_GRANULES]; // Blocks seen, by length / HEAP_ALIGN.
+static uint64_t pad_waste;           // Bytes lost to pad_length() rounding.
+static uint64_t requests;            // Requests seen with their exact length.
+
+void error(char *msg) {
+    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t pad_length(uint64_t length) {
+    return (length + HEAP_ALIGN - 1) / HEAP_ALIGN * HEAP_ALIGN;
+}
+
+// Trace lines are "a <length> ..." and "d ...", histogram lines are
+// "h <block length> <count>"; anything else is ignored.
+static void read_input(FILE *in) {
+    char line[256];
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        unsigned long length, count;
+
+        if (sscanf(line, "a %lu", &length) == 1) {
+            uint64_t padded = pad_length(length + BOUNDARY_SIZE);
+            if (length == 0 || HEAP_GRANULES <= padded / HEAP_ALIGN) {
+                continue;
+            }
+            hist[padded / HEAP_ALIGN]++;
+            pad_waste += padded - (length + BOUNDARY_SIZE);
+            requests++;
+        } else if (sscanf(line, "h %lu %lu", &length, &count) == 2) {
+            if (length % HEAP_ALIGN != 0 ||
+                HEAP_GRANULES <= length / HEAP_ALIGN) {
+                continue;
+            }
+            hist[length / HEAP_ALIGN] += count;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int classes = 16;
+    int arg = 1;
+
+    if (arg + 1 < argc && strcmp(argv[arg], "-n") == 0) {
+        classes = atoi(argv[arg + 1]);
+        arg += 2;
+    }
+    if (classes < 1 || MAX_CLASSES < classes) {
+        fprintf(stderr, "sizeclass_gen: classes must be in 1..%d\n",
+                MAX_CLASSES);
+        return EXIT_FAILURE;
+    }
+
+    if (arg == argc) {
+        read_input(stdin);
+    }
+    for (; arg < argc; arg++) {
+        FILE *in = fopen(argv[arg], "r");
+        if (in == NULL) {
+            error(argv[arg]);
+        }
+        read_input(in);
+        fclose(in);
+    }
+
+    // Only observed sizes are worth a class of their own.
+    uint16_t sizes[HEAP_GRANULES];
+    int m = 0;
+    for (int g = 1; g < HEAP_GRANULES; g++) {
+        if (hist[g] != 0) {
+            sizes[m++] = g;
+        }
+    }
+    if (m == 0) {
+        fprintf(stderr, "sizeclass_gen: no allocations in input\n");
+        return EXIT_FAILURE;
+    }
+    if (m < classes) {
+        classes = m;
+    }
+
+    // count[j] and weight[j] are prefix sums over sizes[0..j), so rounding
+    // sizes[i..j) up to sizes[j - 1] wastes
+    // sizes[j - 1] * (count[j] - count[i]) - (weight[j] - weight[i]) granules.
+    uint64_t count[HEAP_GRANULES + 1] = {0};
+    uint64_t weight[HEAP_GRANULES + 1] = {0};
+    for (int j = 0; j < m; j++) {
+        count[j + 1] = count[j] + hist[sizes[j]];
+        weight[j + 1] = weight[j] + hist[sizes[j]] * sizes[j];
+    }
+
+    // cost[k][j]: least waste covering sizes[0..j) with k classes, the largest
+    // of which is sizes[j - 1]; cut[k][j] is where that last class starts.
+    static uint64_t cost[MAX_CLASSES + 1][HEAP_GRANULES + 1];
+    static uint16_t cut[MAX_CLASSES + 1][HEAP_GRANULES + 1];
+    for (int k = 0; k <= classes; k++) {
+        for (int j = 0; j <= m; j++) {
+            cost[k][j] = UINT64_MAX;
+        }
+    }
+    cost[0][0] = 0;
+    for (int k = 1; k <= classes; k++) {
+        for (int j = k; j <= m; j++) {
+            for (int i = k - 1; i < j; i++) {
+                if (cost[k - 1][i] == UINT64_MAX) {
+                    continue;
+                }
+                uint64_t waste = sizes[j - 1] * (count[j] - count[i]) -
+                                 (weight[j] - weight[i]);
+                if (cost[k - 1][i] + waste < cost[k][j]) {
+                    cost[k][j] = cost[k - 1][i] + waste;
+                    cut[k][j] = i;
+                }
+            }
+        }
+    }
+
+    uint16_t lengths[MAX_CLASSES];
+    for (int k = classes, j = m; 0 < k; j = cut[k][j], k--) {
+        lengths[k - 1] = sizes[j - 1] * HEAP_ALIGN;
+    }
+
+    uint8_t index[HEAP_GRANULES];
+    for (int g = 0, k = 0; g < HEAP_GRANULES; g++) {
+        while (k < classes && lengths[k] < g * HEAP_ALIGN) {
+            k++;
+        }
+        index[g] = (g == 0 || k == classes) ? SIZE_CLASS_NONE : k;
+    }
+
+    printf("// Generated by sizeclass_gen from %lu blocks; do not edit.\n",
+           (unsigned long)count[m]);
+    if (requests != 0) {
+        printf("// pad_length() rounding: %lu bytes over %lu requests.\n",
+               (unsigned long)pad_waste, (unsigned long)requests);
+    }
+    printf("// Class rounding: %lu bytes.\n\n",
+           (unsigned long)(cost[classes][m] * HEAP_ALIGN));
+    printf("#define SIZE_CLASS_COUNT %d\n", classes);
+    printf("#define SIZE_CLASS_NONE 0x%x\n\n", SIZE_CLASS_NONE);
+    printf("// Block length (boundary and padding included) of each class.\n");
+    printf("static const uint16_t SIZE_CLASS_LENGTH[SIZE_CLASS_COUNT] = {");
+    for (int k = 0; k < classes; k++) {
+        printf("%s%u", k % 8 == 0 ? "\n    " : " ", lengths[k]);
+        if (k + 1 < classes) {
+            printf(",");
+        }
+    }
+    printf("\n};\n\n");
+    printf("// Class of a padded block, indexed by length / HEAP_ALIGN.\n");
+    printf("static const uint8_t SIZE_CLASS_INDEX[HEAP_GRANULES] = {");
+    for (int g = 0; g < HEAP_GRANULES; g++) {
+        printf("%s0x%02x", g % 12 == 0 ? "\n    " : " ", index[g]);
+        if (g + 1 < HEAP_GRANULES) {
+            printf(",");
+        }
+    }
+    printf("\n};\n");
+
+    return 0;
+}